@@ -0,0 +1,119 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_ARENA_H
+#define RAY_TRACER_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Types whose destructor frees nothing, so the arena may skip it at teardown. Trivially destructible types
+// qualify automatically; classes that only have an empty virtual destructor opt in by specializing this.
+template <typename T>
+struct ArenaSkipsDestructor : std::is_trivially_destructible<T> {};
+
+// Monotonic allocator for objects that live as long as a scene. Memory comes from large cache-line aligned
+// blocks and is never handed back one object at a time: destroying the arena frees a handful of blocks and
+// only runs the destructors that actually release something. Not thread-safe; scenes are built on one thread.
+class Arena {
+public:
+    static const size_t CacheLine = 64;
+
+    // Blocks start at firstBlockSize and double up to maxBlockSize, so small scenes stay small
+    explicit Arena(size_t firstBlockSize = 64 << 10, size_t maxBlockSize = 4 << 20)
+            : blockSize(firstBlockSize), maxBlockSize(maxBlockSize), current(nullptr), remaining(0), allocations(0),
+              bytesUsed(0), bytesReserved(0) {}
+
+    ~Arena() {
+        for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+            it->second(it->first);
+        }
+        for (void* block : blocks) {
+            ::operator delete(block);
+        }
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(current);
+        size_t padding = (alignment - address % alignment) % alignment;
+        if (current == nullptr || padding + bytes > remaining) {
+            addBlock(bytes + alignment);
+            address = reinterpret_cast<uintptr_t>(current);
+            padding = (alignment - address % alignment) % alignment;
+        }
+        char* result = current + padding;
+        current = result + bytes;
+        remaining -= padding + bytes;
+        allocations++;
+        bytesUsed += bytes;
+        return result;
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!ArenaSkipsDestructor<T>::value) {
+            destructors.push_back(std::make_pair(static_cast<void*>(object), &destroy<T>));
+        }
+        return object;
+    }
+
+    size_t allocationCount() const {
+        return allocations;
+    }
+
+    // Bytes handed out, excluding alignment padding
+    size_t usedBytes() const {
+        return bytesUsed;
+    }
+
+    // Bytes held in blocks; monotonic, so this is also the peak
+    size_t reservedBytes() const {
+        return bytesReserved;
+    }
+
+    size_t blockCount() const {
+        return blocks.size();
+    }
+
+private:
+    size_t blockSize; // Size of the next block
+    size_t maxBlockSize;
+    std::vector<void*> blocks;
+    char* current;    // Next free byte of the newest block
+    size_t remaining; // Bytes left in it
+    std::vector<std::pair<void*, void (*)(void*)>> destructors;
+    size_t allocations;
+    size_t bytesUsed;
+    size_t bytesReserved;
+
+    template <typename T>
+    static void destroy(void* object) {
+        static_cast<T*>(object)->~T();
+    }
+
+    // Oversized requests get a block of their own
+    void addBlock(size_t minimumSize) {
+        size_t size = std::max(blockSize, minimumSize) + CacheLine;
+        void* block = ::operator new(size);
+        blocks.push_back(block);
+        bytesReserved += size;
+        uintptr_t address = reinterpret_cast<uintptr_t>(block);
+        size_t padding = (CacheLine - address % CacheLine) % CacheLine; // Blocks start on a cache line
+        current = static_cast<char*>(block) + padding;
+        remaining = size - padding;
+        blockSize = std::min(blockSize * 2, maxBlockSize);
+    }
+};
+
+
+#endif //RAY_TRACER_ARENA_H
@@ -0,0 +1,84 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_ASYNCIMAGEWRITER_H
+#define RAY_TRACER_ASYNCIMAGEWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "Film.h"
+
+// Writes finished films on a background thread, so encoding and disk I/O overlap with rendering the next
+// frame. At most maxQueued films wait for the writer; write() blocks beyond that to bound memory use.
+class AsyncImageWriter {
+public:
+    explicit AsyncImageWriter(size_t maxQueued = 2) : maxQueued(maxQueued), busy(false), stopping(false) {
+        worker = std::thread([this]() { writerLoop(); });
+    }
+
+    // Writes everything still queued before returning
+    ~AsyncImageWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    AsyncImageWriter(const AsyncImageWriter&) = delete;
+    AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+    // The film must not be modified afterwards; callers hand over a fresh one per frame
+    void write(const std::shared_ptr<const Film>& film, const std::string& filename) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return queue.size() < maxQueued; });
+        queue.push_back(std::make_pair(film, filename));
+        changed.notify_all();
+    }
+
+    // Waits until every film handed to write() is on disk
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return queue.empty() && !busy; });
+    }
+
+private:
+    size_t maxQueued;
+    std::deque<std::pair<std::shared_ptr<const Film>, std::string>> queue;
+    bool busy; // The writer is encoding a film it already took off the queue
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread worker;
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return; // Only when stopping, and after draining the queue
+
+            std::pair<std::shared_ptr<const Film>, std::string> job = queue.front();
+            queue.pop_front();
+            busy = true;
+            changed.notify_all(); // Room in the queue
+            lock.unlock();
+
+            job.first->writeImage(job.second); // Single-threaded: the render pool is busy with the next frame
+
+            lock.lock();
+            busy = false;
+            changed.notify_all();
+        }
+    }
+};
+
+
+#endif //RAY_TRACER_ASYNCIMAGEWRITER_H
@@ -0,0 +1,309 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_BVH_H
+#define RAY_TRACER_BVH_H
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "BoundingBox.h"
+#include "Ray.h"
+#include "RenderStats.h"
+#include "Shape.h"
+#include "ThreadPool.h"
+
+// Bounding volume hierarchy over the scene's objects, built with the binned surface area heuristic (SAH).
+// Objects are referenced by their index in the scene's object list. Meshes use the same tree over their
+// triangles, built from the triangles' bounds.
+//
+// For rigid animation, update() refits node bounds bottom-up after shapes moved (setTransform), which is
+// far cheaper than rebuilding. Refitting keeps the topology, so the tree slowly loses quality; once its
+// SAH cost exceeds rebuildThreshold times the cost right after the last build, it is rebuilt from scratch.
+class BVH {
+public:
+    struct Node {
+        BoundingBox bounds;
+        int left, right;  // Child node indices (internal nodes)
+        int first, count; // Range in objectIndices (leaves have count > 0)
+    };
+
+    int maxLeafSize = 4;
+    float rebuildThreshold = 1.5f;
+
+    bool isBuilt() const {
+        return !nodes.empty();
+    }
+
+    void clear() {
+        nodes.clear();
+        objectIndices.clear();
+        levels.clear();
+        builtCost = 0.0f;
+    }
+
+    size_t nodeCount() const {
+        return nodes.size();
+    }
+
+    void build(const std::vector<std::shared_ptr<Shape>>& objects) {
+        std::vector<BoundingBox> objectBounds(objects.size());
+        for (size_t i = 0; i < objects.size(); i++) {
+            objectBounds[i] = objects[i]->bounds();
+        }
+        build(objectBounds);
+        // Shapes of one type are tested back to back, which keeps the type dispatch predictable
+        sortLeaves([&](int object) { return static_cast<int>(objects[object]->type); });
+    }
+
+    // Builds over primitives that are only known by their bounds; leaves refer to indices into objectBounds
+    void build(const std::vector<BoundingBox>& objectBounds) {
+        clear();
+        if (objectBounds.empty()) return;
+
+        objectIndices.resize(objectBounds.size());
+        for (size_t i = 0; i < objectBounds.size(); i++) {
+            objectIndices[i] = static_cast<int>(i);
+        }
+        nodes.reserve(2 * objectBounds.size());
+        buildNode(objectBounds, 0, static_cast<int>(objectBounds.size()), 0);
+        builtCost = sahCost();
+    }
+
+    // Recomputes every node's bounds from the objects' current bounds, deepest level first. Nodes on one
+    // level don't depend on each other, so each level is refitted in parallel when a pool is given.
+    void refit(const std::vector<std::shared_ptr<Shape>>& objects, ThreadPool* pool = nullptr) {
+        for (int level = static_cast<int>(levels.size()) - 1; level >= 0; level--) {
+            const std::vector<int>& levelNodes = levels[level];
+            auto refitNode = [&](int i, int) {
+                Node& node = nodes[levelNodes[i]];
+                node.bounds = BoundingBox();
+                if (node.count > 0) {
+                    for (int j = node.first; j < node.first + node.count; j++) {
+                        node.bounds.expand(objects[objectIndices[j]]->bounds());
+                    }
+                } else {
+                    node.bounds.expand(nodes[node.left].bounds);
+                    node.bounds.expand(nodes[node.right].bounds);
+                }
+            };
+            if (pool != nullptr && levelNodes.size() >= 256) {
+                pool->parallelFor(static_cast<int>(levelNodes.size()), refitNode, 64);
+            } else {
+                for (size_t i = 0; i < levelNodes.size(); i++) {
+                    refitNode(static_cast<int>(i), 0);
+                }
+            }
+        }
+    }
+
+    // Refits after objects moved and rebuilds if the tree degraded too far. Returns true if it rebuilt.
+    bool update(const std::vector<std::shared_ptr<Shape>>& objects, ThreadPool* pool = nullptr) {
+        if (!isBuilt() || objectIndices.size() != objects.size()) {
+            build(objects);
+            return true;
+        }
+        refit(objects, pool);
+        if (sahCost() > rebuildThreshold * builtCost) {
+            build(objects);
+            return true;
+        }
+        return false;
+    }
+
+    // Expected cost of tracing a random ray, relative to one object test (traversal steps cost 1/2 of a test)
+    float sahCost() const {
+        if (nodes.empty()) return 0.0f;
+        float rootArea = nodes[0].bounds.surfaceArea();
+        if (rootArea <= 0.0f) return 0.0f;
+
+        float cost = 0.0f;
+        for (const Node& node : nodes) {
+            float probability = node.bounds.surfaceArea() / rootArea;
+            cost += probability * (node.count > 0 ? static_cast<float>(node.count) : 0.5f);
+        }
+        return cost;
+    }
+
+    // Visits the objects in every leaf the ray enters before maxDistance, nearest subtree first.
+    // visit(objectIndex, maxDistance) may shrink maxDistance to prune farther nodes, and returns true
+    // to stop the traversal early (e.g. on the first occluder of a shadow ray).
+    template <typename Visitor>
+    void traverse(const Ray& ray, float maxDistance, Visitor visit) const {
+        if (nodes.empty()) return;
+
+        Vector3 inverseDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            const Node& node = nodes[stack[--stackSize]];
+            RT_STAT(nodeVisits, 1);
+            float entry;
+            if (!intersectBox(node.bounds, ray, inverseDirection, maxDistance, entry)) continue;
+
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    if (visit(objectIndices[i], maxDistance)) return;
+                }
+                continue;
+            }
+
+            // Push the farther child first so the nearer one is visited next
+            float leftEntry, rightEntry;
+            bool hitLeft = intersectBox(nodes[node.left].bounds, ray, inverseDirection, maxDistance, leftEntry);
+            bool hitRight = intersectBox(nodes[node.right].bounds, ray, inverseDirection, maxDistance, rightEntry);
+            if (hitLeft && hitRight) {
+                bool leftFirst = leftEntry <= rightEntry;
+                stack[stackSize++] = leftFirst ? node.right : node.left;
+                stack[stackSize++] = leftFirst ? node.left : node.right;
+            } else if (hitLeft) {
+                stack[stackSize++] = node.left;
+            } else if (hitRight) {
+                stack[stackSize++] = node.right;
+            }
+        }
+    }
+
+private:
+    template <typename Key>
+    void sortLeaves(Key key) {
+        for (const Node& node : nodes) {
+            if (node.count > 1) {
+                std::stable_sort(objectIndices.begin() + node.first, objectIndices.begin() + node.first + node.count,
+                                 [&](int a, int b) { return key(a) < key(b); });
+            }
+        }
+    }
+
+    std::vector<Node> nodes;
+    std::vector<int> objectIndices;      // Object indices, reordered so every leaf covers a contiguous range
+    std::vector<std::vector<int>> levels; // Node indices grouped by depth, for level-by-level refitting
+    float builtCost = 0.0f;              // SAH cost right after the last full build
+
+    static const int binCount = 12;
+
+    static bool intersectBox(const BoundingBox& box, const Ray& ray, const Vector3& inverseDirection,
+                             float maxDistance, float& entry) {
+        float t0 = (box.min.x - ray.origin.x) * inverseDirection.x;
+        float t1 = (box.max.x - ray.origin.x) * inverseDirection.x;
+        float tMin = std::min(t0, t1), tMax = std::max(t0, t1);
+
+        t0 = (box.min.y - ray.origin.y) * inverseDirection.y;
+        t1 = (box.max.y - ray.origin.y) * inverseDirection.y;
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+
+        t0 = (box.min.z - ray.origin.z) * inverseDirection.z;
+        t1 = (box.max.z - ray.origin.z) * inverseDirection.z;
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+
+        entry = std::max(tMin, 0.0f);
+        return tMax >= entry && entry <= maxDistance;
+    }
+
+    int buildNode(const std::vector<BoundingBox>& objectBounds, int first, int count, int depth) {
+        int index = static_cast<int>(nodes.size());
+        nodes.push_back(Node());
+        if (static_cast<int>(levels.size()) <= depth) {
+            levels.resize(depth + 1);
+        }
+        levels[depth].push_back(index);
+
+        Node node;
+        node.first = first;
+        node.count = count;
+        node.left = node.right = -1;
+        BoundingBox centroidBounds;
+        for (int i = first; i < first + count; i++) {
+            node.bounds.expand(objectBounds[objectIndices[i]]);
+            centroidBounds.expand(objectBounds[objectIndices[i]].centroid());
+        }
+
+        int mid = -1;
+        if (count > maxLeafSize && depth < 60) {
+            mid = findSplit(objectBounds, node.bounds, centroidBounds, first, count);
+        }
+        if (mid > first && mid < first + count) {
+            node.count = 0;
+            node.left = buildNode(objectBounds, first, mid - first, depth + 1);
+            node.right = buildNode(objectBounds, mid, first + count - mid, depth + 1);
+        }
+
+        nodes[index] = node;
+        return index;
+    }
+
+    // Partitions objectIndices[first, first + count) along the cheapest binned SAH split and returns the split
+    // point, or -1 when keeping a leaf is cheaper. Falls back to a median split when all centroids coincide.
+    int findSplit(const std::vector<BoundingBox>& objectBounds, const BoundingBox& bounds,
+                  const BoundingBox& centroidBounds, int first, int count) {
+        int axis = centroidBounds.longestAxis();
+        float axisMin = axisOf(centroidBounds.min, axis);
+        float axisExtent = axisOf(centroidBounds.max, axis) - axisMin;
+
+        if (axisExtent <= 0.0f) {
+            int mid = first + count / 2;
+            return mid;
+        }
+
+        struct Bin {
+            BoundingBox bounds;
+            int count = 0;
+        };
+        Bin bins[binCount];
+        auto binOf = [&](int object) {
+            int bin = static_cast<int>(binCount * (axisOf(objectBounds[object].centroid(), axis) - axisMin) / axisExtent);
+            return std::min(bin, binCount - 1);
+        };
+        for (int i = first; i < first + count; i++) {
+            Bin& bin = bins[binOf(objectIndices[i])];
+            bin.bounds.expand(objectBounds[objectIndices[i]]);
+            bin.count++;
+        }
+
+        // Sweep from the right to get the cost of every "bins [0, split) | bins [split, binCount)" partition
+        float rightArea[binCount];
+        int rightCount[binCount];
+        BoundingBox accumulated;
+        int accumulatedCount = 0;
+        for (int i = binCount - 1; i > 0; i--) {
+            accumulated.expand(bins[i].bounds);
+            accumulatedCount += bins[i].count;
+            rightArea[i] = accumulated.surfaceArea();
+            rightCount[i] = accumulatedCount;
+        }
+
+        float bestCost = std::numeric_limits<float>::max();
+        int bestSplit = -1;
+        accumulated = BoundingBox();
+        accumulatedCount = 0;
+        for (int split = 1; split < binCount; split++) {
+            accumulated.expand(bins[split - 1].bounds);
+            accumulatedCount += bins[split - 1].count;
+            if (accumulatedCount == 0 || rightCount[split] == 0) continue;
+            float cost = accumulated.surfaceArea() * accumulatedCount + rightArea[split] * rightCount[split];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = split;
+            }
+        }
+
+        float leafCost = bounds.surfaceArea() * count;
+        float splitCost = 0.5f * bounds.surfaceArea() + bestCost; // Traversal step plus both children
+        if (bestSplit < 0 || (splitCost >= leafCost && count <= 4 * maxLeafSize)) {
+            return -1;
+        }
+
+        int* middle = std::partition(objectIndices.data() + first, objectIndices.data() + first + count,
+                                     [&](int object) { return binOf(object) < bestSplit; });
+        return static_cast<int>(middle - objectIndices.data());
+    }
+};
+
+
+#endif //RAY_TRACER_BVH_H
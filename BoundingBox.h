@@ -0,0 +1,74 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_BOUNDINGBOX_H
+#define RAY_TRACER_BOUNDINGBOX_H
+
+#include <algorithm>
+#include <limits>
+
+#include "Vector3.h"
+
+// Axis-aligned bounding box. A default constructed box is empty and grows as points are added.
+class BoundingBox {
+public:
+    Vector3 min;
+    Vector3 max;
+
+    BoundingBox()
+            : min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()),
+              max(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()) {}
+    BoundingBox(const Vector3& min, const Vector3& max) : min(min), max(max) {}
+
+    bool isEmpty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    void expand(const Vector3& point) {
+        min = Vector3(std::min(min.x, point.x), std::min(min.y, point.y), std::min(min.z, point.z));
+        max = Vector3(std::max(max.x, point.x), std::max(max.y, point.y), std::max(max.z, point.z));
+    }
+
+    void expand(const BoundingBox& box) {
+        if (box.isEmpty()) return;
+        expand(box.min);
+        expand(box.max);
+    }
+
+    Vector3 centroid() const {
+        return (min + max) * 0.5f;
+    }
+
+    Vector3 extent() const {
+        return max - min;
+    }
+
+    // Index of the longest axis (0 = x, 1 = y, 2 = z)
+    int longestAxis() const {
+        Vector3 e = extent();
+        if (e.x >= e.y && e.x >= e.z) return 0;
+        return e.y >= e.z ? 1 : 2;
+    }
+
+    float surfaceArea() const {
+        if (isEmpty()) return 0.0f;
+        Vector3 e = extent();
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    // Distance from a point to the closest point of the box (zero when inside)
+    float distanceTo(const Vector3& point) const {
+        float dx = std::max(std::max(min.x - point.x, 0.0f), point.x - max.x);
+        float dy = std::max(std::max(min.y - point.y, 0.0f), point.y - max.y);
+        float dz = std::max(std::max(min.z - point.z, 0.0f), point.z - max.z);
+        return std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+};
+
+static inline float axisOf(const Vector3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+
+#endif //RAY_TRACER_BOUNDINGBOX_H
@@ -0,0 +1,103 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_CAMERAPATH_H
+#define RAY_TRACER_CAMERAPATH_H
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Scene.h"
+
+// Camera keyframes for fly-through animations. The keyframe file has one keyframe per line,
+//     <frame> <eye xyz> <center xyz> <up xyz> <fovy>
+// using the same camera parameters as the scene file's "camera" command. Lines starting with # are comments.
+// Frames between keyframes are linearly interpolated; frames outside the path hold the nearest keyframe.
+class CameraPath {
+public:
+    struct Keyframe {
+        float frame;
+        Vector3 eyePosition, lookAt, up;
+        float fovy;
+    };
+
+    std::vector<Keyframe> keyframes; // Sorted by frame
+
+    void load(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            throw std::runtime_error("Unable to open file");
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream iss(line);
+            Keyframe key;
+            if (line.empty() || line[0] == '#') continue;
+            if (!(iss >> key.frame >> key.eyePosition.x >> key.eyePosition.y >> key.eyePosition.z >> key.lookAt.x >>
+                  key.lookAt.y >> key.lookAt.z >> key.up.x >> key.up.y >> key.up.z >> key.fovy)) {
+                throw std::runtime_error("Malformed keyframe: " + line);
+            }
+            keyframes.push_back(key);
+        }
+        if (keyframes.empty()) {
+            throw std::runtime_error("No keyframes in " + filename);
+        }
+        std::sort(keyframes.begin(), keyframes.end(), [](const Keyframe& a, const Keyframe& b) {
+            return a.frame < b.frame;
+        });
+    }
+
+    // Number of frames needed to reach the last keyframe
+    int frameCount() const {
+        return keyframes.empty() ? 0 : static_cast<int>(keyframes.back().frame) + 1;
+    }
+
+    Keyframe at(float frame) const {
+        if (frame <= keyframes.front().frame) return keyframes.front();
+        if (frame >= keyframes.back().frame) return keyframes.back();
+
+        size_t next = 1;
+        while (keyframes[next].frame < frame) next++;
+        const Keyframe& a = keyframes[next - 1];
+        const Keyframe& b = keyframes[next];
+        float t = (frame - a.frame) / (b.frame - a.frame);
+
+        Keyframe key;
+        key.frame = frame;
+        key.eyePosition = a.eyePosition + (b.eyePosition - a.eyePosition) * t;
+        key.lookAt = a.lookAt + (b.lookAt - a.lookAt) * t;
+        key.up = a.up + (b.up - a.up) * t;
+        key.fovy = a.fovy + (b.fovy - a.fovy) * t;
+        return key;
+    }
+
+    // Moves the scene's camera to the given frame; geometry is left untouched
+    void apply(Scene& scene, float frame) const {
+        Keyframe key = at(frame);
+        scene.setEyePosition(key.eyePosition);
+        scene.setLookAt(key.lookAt);
+        scene.setUp(key.up);
+        scene.setFov(key.fovy);
+        scene.updateVirtualScreen();
+    }
+
+    // "render.png" -> "render_0007.png"
+    static std::string frameFilename(const std::string& filename, int frame) {
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d", frame);
+        size_t dot = filename.find_last_of('.');
+        if (dot == std::string::npos || filename.find('/', dot) != std::string::npos) {
+            return filename + number;
+        }
+        return filename.substr(0, dot) + number + filename.substr(dot);
+    }
+};
+
+
+#endif //RAY_TRACER_CAMERAPATH_H
@@ -0,0 +1,261 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_CHECKPOINT_H
+#define RAY_TRACER_CHECKPOINT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "Film.h"
+#include "Hash.h"
+#include "Tile.h"
+
+// Periodically saves the finished tiles of a long render so that a preempted job can pick up where it left
+// off. Render threads only flag tiles as done (markDone, from the tile callback); a background thread
+// copies the finished pixels and writes them to a temporary file that is then renamed over the checkpoint,
+// so a crash mid-write never leaves a truncated checkpoint behind.
+//
+// File layout: magic, the rendered window, tile size and scene hash (a checkpoint from a different scene,
+// resolution or crop window is ignored), the tile count, one done byte per tile, then the RGB floats of every
+// done tile.
+class Checkpoint {
+public:
+    // window is the part of the image being rendered, see Scene::pixelWindow
+    Checkpoint(const std::string& filename, Film& film, const Tile& window, int tileSize, uint64_t sceneHash,
+               double intervalSeconds = 30.0)
+            : filename(filename), film(film), window(window), tileSize(tileSize), sceneHash(sceneHash),
+              intervalSeconds(intervalSeconds), tiles(Tile::split(window, tileSize)), done(tiles.size(), 0),
+              doneCount(0), savedCount(0), stopping(false) {}
+
+    ~Checkpoint() {
+        stop();
+    }
+
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    // Hash of the scene file's contents and of the size and modification time of the mesh files it loads
+    // (Parser::getMeshFilenames), so editing either invalidates the checkpoint
+    static uint64_t hashFile(const std::string& sceneFile, const std::vector<std::string>& meshFiles = {}) {
+        std::ifstream file(sceneFile, std::ios::binary);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        uint64_t hash = hashBytes(contents.str());
+        for (const std::string& meshFile : meshFiles) {
+            hash = hashFileStamp(meshFile, hash);
+        }
+        return hash;
+    }
+
+    // Loads a matching checkpoint into the film. Returns false if there is none, it belongs to another
+    // render or it is damaged; every tile is then rendered from scratch.
+    bool resume() {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) return false;
+
+        Header header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || !matches(header)) {
+            std::cerr << "Ignoring checkpoint " << filename << ": it belongs to a different render" << std::endl;
+            return false;
+        }
+        std::vector<unsigned char> loadedDone(tiles.size());
+        file.read(reinterpret_cast<char*>(loadedDone.data()), loadedDone.size());
+
+        std::vector<float> data;
+        for (size_t t = 0; t < tiles.size() && file; t++) {
+            if (!loadedDone[t]) continue;
+            data.resize(tiles[t].pixelCount() * 3);
+            file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+            const float* value = data.data();
+            for (int y = tiles[t].y0; y < tiles[t].y1; y++) {
+                for (int x = tiles[t].x0; x < tiles[t].x1; x++, value += 3) {
+                    film.pixel(x, y) = Vector3(value[0], value[1], value[2]);
+                }
+            }
+        }
+        if (!file) {
+            std::cerr << "Ignoring checkpoint " << filename << ": file is truncated" << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        done = loadedDone;
+        doneCount = 0;
+        for (unsigned char flag : done) {
+            doneCount += flag;
+        }
+        savedCount = doneCount;
+        return true;
+    }
+
+    // Tiles not in the checkpoint, i.e. the ones trace still has to render
+    std::vector<Tile> remainingTiles() const {
+        std::vector<Tile> remaining;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t t = 0; t < tiles.size(); t++) {
+            if (!done[t]) {
+                remaining.push_back(tiles[t]);
+            }
+        }
+        return remaining;
+    }
+
+    size_t tileCount() const {
+        return tiles.size();
+    }
+
+    size_t doneTileCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return doneCount;
+    }
+
+    // Called from a render thread once the tile's pixels are in the film
+    void markDone(const Tile& tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!done[tile.index]) {
+            done[tile.index] = 1;
+            doneCount++;
+        }
+    }
+
+    // Starts saving every intervalSeconds in the background, if anything new finished since the last save
+    void start() {
+        writer = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping) {
+                wake.wait_for(lock, std::chrono::duration<double>(intervalSeconds));
+                if (stopping || doneCount == savedCount) continue;
+                lock.unlock();
+                save();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    // Writes the finished tiles now. Pixels of done tiles are no longer written to, so they are copied
+    // without holding the lock the render threads use.
+    void save() {
+        std::vector<unsigned char> snapshot;
+        size_t snapshotCount;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            snapshot = done;
+            snapshotCount = doneCount;
+        }
+
+        std::string temporary = filename + ".tmp";
+        std::FILE* file = std::fopen(temporary.c_str(), "wb");
+        if (file == nullptr) {
+            std::cerr << "Unable to write checkpoint " << temporary << std::endl;
+            return;
+        }
+        Header header = currentHeader();
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  std::fwrite(snapshot.data(), 1, snapshot.size(), file) == snapshot.size();
+
+        std::vector<float> data;
+        for (size_t t = 0; t < tiles.size() && ok; t++) {
+            if (!snapshot[t]) continue;
+            data.clear();
+            for (int y = tiles[t].y0; y < tiles[t].y1; y++) {
+                for (int x = tiles[t].x0; x < tiles[t].x1; x++) {
+                    const Vector3& color = film.pixel(x, y);
+                    data.push_back(color.x);
+                    data.push_back(color.y);
+                    data.push_back(color.z);
+                }
+            }
+            ok = std::fwrite(data.data(), sizeof(float), data.size(), file) == data.size();
+        }
+        ok = std::fflush(file) == 0 && ok;
+        ok = ::fsync(::fileno(file)) == 0 && ok; // The rename must not overtake the data on a power loss
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Unable to write checkpoint " << filename << std::endl;
+            std::remove(temporary.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        savedCount = snapshotCount;
+    }
+
+    // Deletes the checkpoint once the image it was protecting has been written
+    void remove() {
+        std::remove(filename.c_str());
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        int32_t x0, y0, x1, y1; // Rendered window
+        int32_t tileSize, tileCount;
+        uint64_t sceneHash;
+    };
+
+    std::string filename;
+    Film& film;
+    Tile window;
+    int tileSize;
+    uint64_t sceneHash;
+    double intervalSeconds;
+    std::vector<Tile> tiles;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<unsigned char> done; // Per tile, guarded by mutex
+    size_t doneCount;
+    size_t savedCount;               // doneCount at the last successful save
+    bool stopping;
+    std::thread writer;
+
+    Header currentHeader() const {
+        Header header;
+        std::memcpy(header.magic, "RTCKPT1", 8);
+        header.x0 = window.x0;
+        header.y0 = window.y0;
+        header.x1 = window.x1;
+        header.y1 = window.y1;
+        header.tileSize = tileSize;
+        header.tileCount = static_cast<int32_t>(tiles.size());
+        header.sceneHash = sceneHash;
+        return header;
+    }
+
+    bool matches(const Header& header) const {
+        Header expected = currentHeader();
+        return std::memcmp(header.magic, expected.magic, 8) == 0 && header.x0 == expected.x0 &&
+               header.y0 == expected.y0 && header.x1 == expected.x1 && header.y1 == expected.y1 &&
+               header.tileSize == expected.tileSize &&
+               header.tileCount == expected.tileCount && header.sceneHash == expected.sceneHash;
+    }
+};
+
+
+#endif //RAY_TRACER_CHECKPOINT_H
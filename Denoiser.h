@@ -0,0 +1,234 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_DENOISER_H
+#define RAY_TRACER_DENOISER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "Film.h"
+#include "ThreadPool.h"
+#include "Timeline.h"
+
+// Joint bilateral filter guided by the film's feature buffers. A neighbour's weight falls off with its
+// distance and with how much its albedo, normal, relative depth and color differ from the center pixel. Color
+// differences are measured against the two pixels' sample variance, so noise is averaged away while real
+// detail the features don't see (shadow edges, reflections) is kept where the pixels have converged. The
+// image is split into planes of floats, and the filter walks over the window offsets one at a time, weighting
+// a whole row per offset: the inner loop is a straight pass over contiguous floats. It uses AVX2 when the
+// compiler targets it and a vectorizable loop otherwise.
+class Denoiser {
+public:
+    int radius = 5;             // Window is (2 * radius + 1)^2 pixels
+    float sigmaSpatial = 2.5f;  // Pixels
+    float sigmaColor = 0.02f;   // Difference in color tolerated even between converged pixels
+    float varianceScale = 4.0f; // Color differences up to about sqrt(varianceScale) standard deviations count as noise
+    float sigmaAlbedo = 0.05f;  // Difference in kd
+    float sigmaNormal = 0.15f;  // Distance between unit normals
+    float sigmaDepth = 0.02f;   // Depth difference relative to the center pixel's depth
+
+    // Replaces the film's pixels with the filtered image. Rows are spread over the pool's workers if given.
+    void denoise(Film& film, ThreadPool* pool = nullptr) const {
+        if (!film.hasFeatureBuffers()) {
+            throw std::runtime_error("Denoising needs the film's feature buffers");
+        }
+        TimelineScope timelineScope("denoise");
+        Planes planes(film);
+        std::vector<Vector3> filtered(film.pixels.size());
+
+        auto filterRow = [&](int y, int) {
+            filterRowInto(planes, y, &filtered[static_cast<size_t>(y) * planes.width]);
+        };
+        if (pool != nullptr) {
+            pool->parallelFor(planes.height, filterRow, 4);
+        } else {
+            for (int y = 0; y < planes.height; y++) {
+                filterRow(y, 0);
+            }
+        }
+        film.pixels.swap(filtered);
+    }
+
+private:
+    // Structure-of-arrays copy of the film: one contiguous float plane per channel
+    struct Planes {
+        int width, height;
+        std::vector<float> channels[11]; // Color rgb, albedo rgb, normal xyz, depth, variance
+
+        explicit Planes(const Film& film) : width(film.width), height(film.height) {
+            size_t count = film.pixels.size();
+            for (std::vector<float>& channel : channels) {
+                channel.resize(count);
+            }
+            for (size_t i = 0; i < count; i++) {
+                const Vector3* vectors[3] = {&film.pixels[i], &film.albedo[i], &film.normals[i]};
+                for (int v = 0; v < 3; v++) {
+                    channels[v * 3 + 0][i] = vectors[v]->x;
+                    channels[v * 3 + 1][i] = vectors[v]->y;
+                    channels[v * 3 + 2][i] = vectors[v]->z;
+                }
+                channels[9][i] = film.depth[i];
+                channels[10][i] = film.variance[i];
+            }
+        }
+
+        const float* row(int channel, int y) const {
+            return channels[channel].data() + static_cast<size_t>(y) * width;
+        }
+    };
+
+    // Terms of the weight's exponent, as factors of squared differences. The color term is divided by
+    // colorBase + varianceScale * (variance of both pixels) instead.
+    struct Scales {
+        float colorBase, variance, albedo, normal;
+    };
+
+    void filterRowInto(const Planes& planes, int y, Vector3* out) const {
+        const int width = planes.width;
+        std::vector<float> sums(4 * static_cast<size_t>(width), 0.0f); // r, g, b and weight, plane by plane
+        float* sumR = sums.data();
+        float* sumG = sumR + width;
+        float* sumB = sumG + width;
+        float* sumW = sumB + width;
+
+        Scales scales = {2.0f * sigmaColor * sigmaColor, 2.0f * varianceScale, 1.0f / (2.0f * sigmaAlbedo * sigmaAlbedo),
+                         1.0f / (2.0f * sigmaNormal * sigmaNormal)};
+        std::vector<float> depthScale(width);
+        const float* centerDepth = planes.row(9, y);
+        for (int x = 0; x < width; x++) {
+            depthScale[x] = 1.0f / (2.0f * sigmaDepth * sigmaDepth * std::max(centerDepth[x] * centerDepth[x], 1e-8f));
+        }
+
+        const float* center[11];
+        for (int c = 0; c < 11; c++) {
+            center[c] = planes.row(c, y);
+        }
+
+        for (int dy = -radius; dy <= radius; dy++) {
+            int ny = y + dy;
+            if (ny < 0 || ny >= planes.height) continue;
+            for (int dx = -radius; dx <= radius; dx++) {
+                // Pixels x0..x1 have their neighbour at x + dx inside the image
+                int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+                if (x0 >= x1) continue;
+                const float* neighbour[11];
+                for (int c = 0; c < 11; c++) {
+                    neighbour[c] = planes.row(c, ny) + dx;
+                }
+                float spatial = (dx * dx + dy * dy) / (2.0f * sigmaSpatial * sigmaSpatial);
+                accumulate(center, centerDepth, neighbour, depthScale.data(), scales, spatial, x0, x1,
+                           sumR, sumG, sumB, sumW);
+            }
+        }
+
+        for (int x = 0; x < width; x++) {
+            float weight = sumW[x]; // At least the center pixel's weight of 1
+            out[x] = Vector3(sumR[x] / weight, sumG[x] / weight, sumB[x] / weight);
+        }
+    }
+
+    // Adds the weighted neighbours at one window offset for pixels x0..x1 of a row
+    static void accumulate(const float* const* center, const float* centerDepth, const float* const* neighbour,
+                           const float* depthScale, const Scales& scales, float spatial, int x0, int x1,
+                           float* sumR, float* sumG, float* sumB, float* sumW) {
+        int x = x0;
+#ifdef __AVX2__
+        const __m256 colorBase = _mm256_set1_ps(scales.colorBase), varianceScale = _mm256_set1_ps(scales.variance),
+                albedoScale = _mm256_set1_ps(scales.albedo), normalScale = _mm256_set1_ps(scales.normal),
+                spatialTerm = _mm256_set1_ps(spatial);
+        for (; x + 8 <= x1; x += 8) {
+            __m256 nr = _mm256_loadu_ps(neighbour[0] + x), ng = _mm256_loadu_ps(neighbour[1] + x),
+                    nb = _mm256_loadu_ps(neighbour[2] + x);
+            __m256 color = _mm256_add_ps(_mm256_add_ps(square(_mm256_sub_ps(nr, _mm256_loadu_ps(center[0] + x))),
+                                                       square(_mm256_sub_ps(ng, _mm256_loadu_ps(center[1] + x)))),
+                                         square(_mm256_sub_ps(nb, _mm256_loadu_ps(center[2] + x))));
+            __m256 albedo = _mm256_setzero_ps(), normal = _mm256_setzero_ps();
+            for (int c = 0; c < 3; c++) {
+                albedo = _mm256_add_ps(albedo, square(_mm256_sub_ps(_mm256_loadu_ps(neighbour[3 + c] + x),
+                                                                    _mm256_loadu_ps(center[3 + c] + x))));
+                normal = _mm256_add_ps(normal, square(_mm256_sub_ps(_mm256_loadu_ps(neighbour[6 + c] + x),
+                                                                    _mm256_loadu_ps(center[6 + c] + x))));
+            }
+            __m256 depth = _mm256_mul_ps(square(_mm256_sub_ps(_mm256_loadu_ps(neighbour[9] + x),
+                                                              _mm256_loadu_ps(centerDepth + x))),
+                                         _mm256_loadu_ps(depthScale + x));
+            __m256 variance = _mm256_add_ps(_mm256_loadu_ps(neighbour[10] + x), _mm256_loadu_ps(center[10] + x));
+            color = _mm256_div_ps(color, _mm256_add_ps(colorBase, _mm256_mul_ps(variance, varianceScale)));
+            __m256 exponent = _mm256_add_ps(_mm256_add_ps(spatialTerm, color),
+                                            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(albedo, albedoScale),
+                                                                        _mm256_mul_ps(normal, normalScale)), depth));
+            __m256 weight = expNegative(exponent);
+            _mm256_storeu_ps(sumR + x, _mm256_add_ps(_mm256_loadu_ps(sumR + x), _mm256_mul_ps(weight, nr)));
+            _mm256_storeu_ps(sumG + x, _mm256_add_ps(_mm256_loadu_ps(sumG + x), _mm256_mul_ps(weight, ng)));
+            _mm256_storeu_ps(sumB + x, _mm256_add_ps(_mm256_loadu_ps(sumB + x), _mm256_mul_ps(weight, nb)));
+            _mm256_storeu_ps(sumW + x, _mm256_add_ps(_mm256_loadu_ps(sumW + x), weight));
+        }
+#endif
+        for (; x < x1; x++) {
+            float dr = neighbour[0][x] - center[0][x], dg = neighbour[1][x] - center[1][x],
+                    db = neighbour[2][x] - center[2][x];
+            float albedo = 0.0f, normal = 0.0f;
+            for (int c = 0; c < 3; c++) {
+                float da = neighbour[3 + c][x] - center[3 + c][x], dn = neighbour[6 + c][x] - center[6 + c][x];
+                albedo += da * da;
+                normal += dn * dn;
+            }
+            float dd = neighbour[9][x] - centerDepth[x];
+            float variance = neighbour[10][x] + center[10][x];
+            // Same operations in the same order as the AVX2 body, so every pixel gets the same weight either way
+            float color = (dr * dr + dg * dg + db * db) / (scales.colorBase + variance * scales.variance);
+            float exponent = (spatial + color) + ((albedo * scales.albedo + normal * scales.normal) +
+                                                  dd * dd * depthScale[x]);
+            float weight = expNegative(exponent);
+            sumR[x] += weight * neighbour[0][x];
+            sumG[x] += weight * neighbour[1][x];
+            sumB[x] += weight * neighbour[2][x];
+            sumW[x] += weight;
+        }
+    }
+
+    // exp(-e) for e >= 0 to about 1e-4 relative error: 2^t split into an integer power, put straight into
+    // the float's exponent bits, and a polynomial for the fraction. Tiny weights flush to 0.
+    static float expNegative(float e) {
+        float t = std::max(-e * 1.44269504f, -126.0f); // -e / ln 2
+        int whole = static_cast<int>(t) - 1;            // t - whole is in (0, 1]
+        float f = t - whole;
+        float p = 1.0f + f * (0.693147f + f * (0.240227f + f * (0.0555041f + f * (0.00961813f + f * 0.00133336f))));
+        int32_t bits = (whole + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+#ifdef __AVX2__
+    static __m256 square(__m256 v) {
+        return _mm256_mul_ps(v, v);
+    }
+
+    static __m256 expNegative(__m256 e) {
+        __m256 t = _mm256_max_ps(_mm256_mul_ps(e, _mm256_set1_ps(-1.44269504f)), _mm256_set1_ps(-126.0f));
+        __m256i whole = _mm256_sub_epi32(_mm256_cvttps_epi32(t), _mm256_set1_epi32(1));
+        __m256 f = _mm256_sub_ps(t, _mm256_cvtepi32_ps(whole));
+        __m256 p = _mm256_set1_ps(0.00133336f);
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.00961813f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.0555041f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.240227f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.693147f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+        __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(whole, _mm256_set1_epi32(127)), 23));
+        return _mm256_mul_ps(p, scale);
+    }
+#endif
+};
+
+
+#endif //RAY_TRACER_DENOISER_H
@@ -0,0 +1,131 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_EXRWRITER_H
+#define RAY_TRACER_EXRWRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "Tile.h"
+#include "Timeline.h"
+
+// Writes multi-channel float images as uncompressed scanline OpenEXR, which compositing tools and image
+// libraries read without further dependencies. Channels are 32-bit float or unsigned int planes; the
+// data window may be a crop of the display window, so crop renders keep their place in the frame.
+class ExrWriter {
+public:
+    enum class PixelType : int32_t {
+        Uint = 0,
+        Float = 2
+    };
+
+    struct Channel {
+        std::string name;
+        PixelType type;
+        const void* data; // window.pixelCount() values of 4 bytes, row-major, top row first
+    };
+
+    // window is the part of the imageWidth x imageHeight frame the channels cover. Returns false if the file
+    // couldn't be written.
+    static bool write(const std::string& filename, std::vector<Channel> channels, const Tile& window,
+                      int imageWidth, int imageHeight) {
+        TimelineScope timelineScope("write exr");
+        // Readers expect the channel list sorted by name
+        std::sort(channels.begin(), channels.end(), [](const Channel& a, const Channel& b) { return a.name < b.name; });
+
+        std::vector<uint8_t> file;
+        put32(file, 20000630); // Magic number
+        put32(file, 2);        // Version 2, single-part scanline file
+
+        std::vector<uint8_t> channelList;
+        for (const Channel& channel : channels) {
+            channelList.insert(channelList.end(), channel.name.begin(), channel.name.end());
+            channelList.push_back(0);
+            put32(channelList, static_cast<uint32_t>(channel.type));
+            put32(channelList, 0); // pLinear and three reserved bytes
+            put32(channelList, 1); // x sampling
+            put32(channelList, 1); // y sampling
+        }
+        channelList.push_back(0);
+        attribute(file, "channels", "chlist", channelList);
+        attribute(file, "compression", "compression", std::vector<uint8_t>(1, 0));
+        attribute(file, "dataWindow", "box2i", box(window.x0, window.y0, window.x1 - 1, window.y1 - 1));
+        attribute(file, "displayWindow", "box2i", box(0, 0, imageWidth - 1, imageHeight - 1));
+        attribute(file, "lineOrder", "lineOrder", std::vector<uint8_t>(1, 0)); // Increasing y
+        attribute(file, "pixelAspectRatio", "float", floats({1.0f}));
+        attribute(file, "screenWindowCenter", "v2f", floats({0.0f, 0.0f}));
+        attribute(file, "screenWindowWidth", "float", floats({1.0f}));
+        file.push_back(0); // End of header
+
+        // Offset table, then one block per scanline: y, byte count and each channel's row in turn
+        int width = window.width(), height = window.height();
+        uint32_t rowBytes = static_cast<uint32_t>(width) * 4 * static_cast<uint32_t>(channels.size());
+        uint64_t blockOffset = file.size() + static_cast<uint64_t>(height) * 8;
+        for (int y = 0; y < height; y++) {
+            put64(file, blockOffset + static_cast<uint64_t>(y) * (8 + rowBytes));
+        }
+        file.reserve(file.size() + static_cast<size_t>(height) * (8 + rowBytes));
+        for (int y = 0; y < height; y++) {
+            put32(file, static_cast<uint32_t>(window.y0 + y));
+            put32(file, rowBytes);
+            for (const Channel& channel : channels) {
+                // Copied as is: EXR is little-endian, like the hosts we run on
+                const uint8_t* row = static_cast<const uint8_t*>(channel.data) + static_cast<size_t>(y) * width * 4;
+                file.insert(file.end(), row, row + static_cast<size_t>(width) * 4);
+            }
+        }
+
+        std::FILE* out = std::fopen(filename.c_str(), "wb");
+        if (out == nullptr) return false;
+        bool ok = std::fwrite(file.data(), 1, file.size(), out) == file.size();
+        return std::fclose(out) == 0 && ok;
+    }
+
+private:
+    static void put32(std::vector<uint8_t>& out, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    static void put64(std::vector<uint8_t>& out, uint64_t value) {
+        put32(out, static_cast<uint32_t>(value));
+        put32(out, static_cast<uint32_t>(value >> 32));
+    }
+
+    static void attribute(std::vector<uint8_t>& out, const char* name, const char* type,
+                          const std::vector<uint8_t>& value) {
+        out.insert(out.end(), name, name + std::strlen(name) + 1);
+        out.insert(out.end(), type, type + std::strlen(type) + 1);
+        put32(out, static_cast<uint32_t>(value.size()));
+        out.insert(out.end(), value.begin(), value.end());
+    }
+
+    static std::vector<uint8_t> box(int xMin, int yMin, int xMax, int yMax) {
+        std::vector<uint8_t> value;
+        for (int v : {xMin, yMin, xMax, yMax}) {
+            put32(value, static_cast<uint32_t>(v));
+        }
+        return value;
+    }
+
+    static std::vector<uint8_t> floats(std::initializer_list<float> values) {
+        std::vector<uint8_t> value;
+        for (float f : values) {
+            uint32_t bits;
+            std::memcpy(&bits, &f, sizeof(bits));
+            put32(value, bits);
+        }
+        return value;
+    }
+};
+
+
+#endif //RAY_TRACER_EXRWRITER_H
@@ -5,32 +5,191 @@
 #ifndef RAY_TRACER_FILM_H
 #define RAY_TRACER_FILM_H
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include "ExrWriter.h"
+#include "Hash.h"
+#include "ImageWriter.h"
+#include "ThreadPool.h"
+#include "Tile.h"
+#include "Timeline.h"
 
+// Pixel buffer. It either covers the whole image or, for crop-window renders, just a window of it; pixels
+// are always addressed by their position in the whole image.
 class Film {
 public:
     int width, height;
     std::vector<Vector3> pixels;
+    int originX = 0, originY = 0; // Image position of pixels[0], non-zero for cropped buffers
 
     Film(int width, int height) : width(width), height(height), pixels(width * height, Vector3(0, 0, 0)) {}
 
+    // Cropped buffer covering only the given window of the image
+    explicit Film(const Tile& window) : width(window.width()), height(window.height()),
+                                        pixels(window.pixelCount(), Vector3(0, 0, 0)), originX(window.x0),
+                                        originY(window.y0) {}
+
+    // The part of the image this film covers
+    Tile window() const {
+        return Tile(originX, originY, originX + width, originY + height, 0);
+    }
+
+    Vector3& pixel(int x, int y) {
+        return pixels[(y - originY) * width + (x - originX)];
+    }
+
+    const Vector3& pixel(int x, int y) const {
+        return pixels[(y - originY) * width + (x - originX)];
+    }
+
     void addSample(int x, int y, const Vector3& color) {
-        pixels[y * width + x] = color;
+        pixel(x, y) = color;
+    }
+
+    // Hash of the pixels' bytes: equal for identical renders, e.g. of the same frame with other thread counts
+    uint64_t hash() const {
+        return hashBytes(pixels.data(), pixels.size() * sizeof(Vector3));
+    }
+
+    std::vector<float> costs; // Per-pixel traversal cost, only filled by instrumentation builds
+
+    void enableCostBuffer() {
+        costs.assign(width * height, 0.0f);
+    }
+
+    bool hasCostBuffer() const {
+        return !costs.empty();
+    }
+
+    void addCost(int x, int y, float cost) {
+        costs[(y - originY) * width + (x - originX)] = cost;
+    }
+
+    // Feature buffers (AOVs) of the primary hits. They guide the Denoiser and can be written out with writeAovs.
+    std::vector<Vector3> albedo;  // Diffuse reflectance kd, averaged over the pixel's samples
+    std::vector<Vector3> normals; // World-space normal, averaged
+    std::vector<float> depth;     // Distance from the camera, averaged; 0 where the ray escaped
+    std::vector<float> variance;  // Variance of the pixel's mean color, averaged over the channels (0 for one sample)
+    std::vector<uint32_t> objectIds;    // Scene object index + 1 of the first sample's hit, 0 for the background
+    std::vector<uint32_t> primitiveIds; // Triangle or sphere within that object, in input order
+
+    struct Features {
+        Vector3 albedo, normal;
+        float depth, variance;
+        uint32_t objectId, primitiveId;
+    };
+
+    void enableFeatureBuffers() {
+        albedo.assign(width * height, Vector3(0, 0, 0));
+        normals.assign(width * height, Vector3(0, 0, 0));
+        depth.assign(width * height, 0.0f);
+        variance.assign(width * height, 0.0f);
+        objectIds.assign(width * height, 0);
+        primitiveIds.assign(width * height, 0);
     }
 
-    void writeImage(const std::string& filename) const {
+    bool hasFeatureBuffers() const {
+        return !depth.empty();
+    }
+
+    void addFeatures(int x, int y, const Features& features) {
+        int index = (y - originY) * width + (x - originX);
+        albedo[index] = features.albedo;
+        normals[index] = features.normal;
+        depth[index] = features.depth;
+        variance[index] = features.variance;
+        objectIds[index] = features.objectId;
+        primitiveIds[index] = features.primitiveId;
+    }
+
+    // Writes the color and every feature buffer as float (IDs: unsigned int) channels of one OpenEXR file.
+    // imageWidth x imageHeight is the full frame, which this film may be a crop of.
+    bool writeAovs(const std::string& filename, int imageWidth, int imageHeight) const {
+        std::vector<float> planes[9]; // R G B, albedo RGB, normal XYZ
+        const std::vector<Vector3>* sources[3] = {&pixels, &albedo, &normals};
+        for (int v = 0; v < 3; v++) {
+            for (int c = 0; c < 3; c++) {
+                std::vector<float>& plane = planes[v * 3 + c];
+                plane.resize(pixels.size());
+                for (size_t i = 0; i < pixels.size(); i++) {
+                    const Vector3& value = (*sources[v])[i];
+                    plane[i] = c == 0 ? value.x : (c == 1 ? value.y : value.z);
+                }
+            }
+        }
+        typedef ExrWriter::PixelType Type;
+        std::vector<ExrWriter::Channel> channels = {
+                {"R", Type::Float, planes[0].data()}, {"G", Type::Float, planes[1].data()},
+                {"B", Type::Float, planes[2].data()}, {"albedo.R", Type::Float, planes[3].data()},
+                {"albedo.G", Type::Float, planes[4].data()}, {"albedo.B", Type::Float, planes[5].data()},
+                {"N.X", Type::Float, planes[6].data()}, {"N.Y", Type::Float, planes[7].data()},
+                {"N.Z", Type::Float, planes[8].data()}, {"Z", Type::Float, depth.data()},
+                {"variance", Type::Float, variance.data()}, {"objectId", Type::Uint, objectIds.data()},
+                {"primitiveId", Type::Uint, primitiveIds.data()}};
+        if (!ExrWriter::write(filename, channels, window(), imageWidth, imageHeight)) {
+            std::cerr << "Unable to write AOVs to " << filename << std::endl;
+            return false;
+        }
+        std::cout << "AOVs written to " << filename << std::endl;
+        return true;
+    }
+
+    // The format follows the extension, see ImageWriter. With a pool, pixel conversion and PNG compression
+    // are spread over its workers. Returns false if the file couldn't be written.
+    bool writeImage(const std::string& filename, ThreadPool* pool = nullptr) const {
+        return writePixels(pixels, filename, pool);
+    }
+
+    // Writes the cost buffer as a false-color image: blue for cheap pixels through to red for the most expensive
+    void writeHeatmap(const std::string& filename) const {
+        float maxCost = 0.0f;
+        for (float cost : costs) {
+            maxCost = std::max(maxCost, cost);
+        }
+
+        std::vector<Vector3> colors(costs.size());
+        for (size_t i = 0; i < costs.size(); i++) {
+            colors[i] = heatColor(maxCost > 0 ? costs[i] / maxCost : 0.0f);
+        }
+        writePixels(colors, filename);
+        std::cout << "Maximum per-pixel cost: " << maxCost << std::endl;
+    }
+
+private:
+    bool writePixels(const std::vector<Vector3>& colors, const std::string& filename, ThreadPool* pool = nullptr) const {
+        TimelineScope timelineScope("write image");
         std::vector<uint8_t> image(width * height * 3);
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                Vector3 color = pixels[y * width + x];
-                image[(y * width + x) * 3 + 0] = static_cast<uint8_t>(color.x * 255);
-                image[(y * width + x) * 3 + 1] = static_cast<uint8_t>(color.y * 255);
-                image[(y * width + x) * 3 + 2] = static_cast<uint8_t>(color.z * 255);
+        {
+            TimelineScope convertScope("convert pixels");
+            auto convertRow = [&](int y, int) {
+                for (int x = 0; x < width; x++) {
+                    Vector3 color = colors[y * width + x];
+                    image[(y * width + x) * 3 + 0] = static_cast<uint8_t>(color.x * 255);
+                    image[(y * width + x) * 3 + 1] = static_cast<uint8_t>(color.y * 255);
+                    image[(y * width + x) * 3 + 2] = static_cast<uint8_t>(color.z * 255);
+                }
+            };
+            if (pool != nullptr) {
+                pool->parallelFor(height, convertRow, 16);
+            } else {
+                for (int y = 0; y < height; y++) {
+                    convertRow(y, 0);
+                }
             }
         }
-        stbi_write_png(filename.c_str(), width, height, 3, image.data(), width * 3);
+        if (!ImageWriter::write(filename, width, height, image, pool)) {
+            std::cerr << "Unable to write image " << filename << std::endl;
+            return false;
+        }
         std::cout << "Image written to " << filename << std::endl;
+        return true;
+    }
+
+    // Blue -> cyan -> green -> yellow -> red ramp for t in [0, 1]
+    static Vector3 heatColor(float t) {
+        t = std::min(std::max(t, 0.0f), 1.0f) * 4.0f;
+        if (t < 1.0f) return Vector3(0, t, 1);
+        if (t < 2.0f) return Vector3(0, 1, 2.0f - t);
+        if (t < 3.0f) return Vector3(t - 2.0f, 1, 0);
+        return Vector3(1, 4.0f - t, 0);
     }
 };
 
@@ -0,0 +1,44 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_HASH_H
+#define RAY_TRACER_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <sys/stat.h>
+
+// 64-bit FNV-1a, used to recognize scene files that haven't changed (server cache, checkpoints) and to
+// compare rendered images
+static inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t hashBytes(const std::string& bytes, uint64_t hash = 14695981039346656037ULL) {
+    return hashBytes(bytes.data(), bytes.size(), hash);
+}
+
+// Folds a file's path, size and modification time into hash. Notices edits to large inputs such as meshes
+// without reading them; a missing file hashes as just its path.
+static inline uint64_t hashFileStamp(const std::string& filename, uint64_t hash = 14695981039346656037ULL) {
+    hash = hashBytes(filename, hash);
+    struct stat info;
+    if (::stat(filename.c_str(), &info) != 0) return hash;
+#ifdef __linux__
+    int64_t stamp[3] = {static_cast<int64_t>(info.st_size), static_cast<int64_t>(info.st_mtim.tv_sec),
+                        static_cast<int64_t>(info.st_mtim.tv_nsec)};
+#else
+    int64_t stamp[3] = {static_cast<int64_t>(info.st_size), static_cast<int64_t>(info.st_mtime), 0};
+#endif
+    return hashBytes(stamp, sizeof(stamp), hash);
+}
+
+
+#endif //RAY_TRACER_HASH_H
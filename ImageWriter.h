@@ -0,0 +1,116 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_IMAGEWRITER_H
+#define RAY_TRACER_IMAGEWRITER_H
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "PngEncoder.h"
+#include "ThreadPool.h"
+#include "Timeline.h"
+
+// Writes 8-bit RGB images, choosing the format from the file extension:
+//     .png         compressed with PngEncoder, in parallel when a pool is given
+//     .ppm, .bmp   uncompressed, for when disk bandwidth matters more than file size
+//     .jpg, .tga   through stb_image_write
+// Unknown extensions are written as PNG.
+class ImageWriter {
+public:
+    // rgb holds height rows of width * 3 bytes, top row first. Returns false if the file couldn't be written
+    // or the image is empty.
+    static bool write(const std::string& filename, int width, int height, const std::vector<uint8_t>& rgb,
+                      ThreadPool* pool = nullptr) {
+        if (width <= 0 || height <= 0) return false;
+        std::string extension = extensionOf(filename);
+        TimelineScope encodeScope("encode image");
+        if (extension == "ppm") {
+            return writePpm(filename, width, height, rgb);
+        }
+        if (extension == "bmp") {
+            return writeBmp(filename, width, height, rgb);
+        }
+        if (extension == "jpg" || extension == "jpeg") {
+            return stbi_write_jpg(filename.c_str(), width, height, 3, rgb.data(), 95) != 0;
+        }
+        if (extension == "tga") {
+            return stbi_write_tga(filename.c_str(), width, height, 3, rgb.data()) != 0;
+        }
+        std::vector<uint8_t> png = PngEncoder::encode(rgb.data(), width, height, pool);
+        return writeFile(filename, {png.data()}, {png.size()});
+    }
+
+private:
+    static std::string extensionOf(const std::string& filename) {
+        size_t dot = filename.find_last_of('.');
+        if (dot == std::string::npos || filename.find('/', dot) != std::string::npos) return "";
+        std::string extension = filename.substr(dot + 1);
+        for (char& c : extension) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return extension;
+    }
+
+    static bool writeFile(const std::string& filename, std::initializer_list<const uint8_t*> parts,
+                          std::initializer_list<size_t> sizes) {
+        std::FILE* file = std::fopen(filename.c_str(), "wb");
+        if (file == nullptr) return false;
+        bool ok = true;
+        const size_t* size = sizes.begin();
+        for (const uint8_t* part : parts) {
+            ok = ok && std::fwrite(part, 1, *size, file) == *size;
+            size++;
+        }
+        return std::fclose(file) == 0 && ok;
+    }
+
+    // Binary PPM: a text header and the raw pixels
+    static bool writePpm(const std::string& filename, int width, int height, const std::vector<uint8_t>& rgb) {
+        std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        return writeFile(filename, {reinterpret_cast<const uint8_t*>(header.data()), rgb.data()},
+                         {header.size(), rgb.size()});
+    }
+
+    // 24-bit BMP: BGR rows, bottom row first, each padded to a multiple of 4 bytes
+    static bool writeBmp(const std::string& filename, int width, int height, const std::vector<uint8_t>& rgb) {
+        size_t rowSize = (static_cast<size_t>(width) * 3 + 3) & ~size_t(3);
+        std::vector<uint8_t> pixels(rowSize * height, 0);
+        for (int y = 0; y < height; y++) {
+            const uint8_t* source = &rgb[static_cast<size_t>(height - 1 - y) * width * 3];
+            uint8_t* target = &pixels[y * rowSize];
+            for (int x = 0; x < width; x++) {
+                target[x * 3 + 0] = source[x * 3 + 2];
+                target[x * 3 + 1] = source[x * 3 + 1];
+                target[x * 3 + 2] = source[x * 3 + 0];
+            }
+        }
+
+        uint8_t header[54] = {'B', 'M'};
+        auto put32 = [&](int offset, uint32_t value) {
+            for (int i = 0; i < 4; i++) {
+                header[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+            }
+        };
+        put32(2, static_cast<uint32_t>(sizeof(header) + pixels.size())); // File size
+        put32(10, sizeof(header));                                         // Pixel data offset
+        put32(14, 40);                                                     // BITMAPINFOHEADER size
+        put32(18, static_cast<uint32_t>(width));
+        put32(22, static_cast<uint32_t>(height));
+        header[26] = 1;  // Planes
+        header[28] = 24; // Bits per pixel
+        put32(34, static_cast<uint32_t>(pixels.size()));
+        return writeFile(filename, {header, pixels.data()}, {sizeof(header), pixels.size()});
+    }
+};
+
+
+#endif //RAY_TRACER_IMAGEWRITER_H
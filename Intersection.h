@@ -16,12 +16,15 @@ public:
     Vector3 normal;         // Transformed normal at the intersection
     Vector3 originalPoint;  // Original point of intersection (before any transformations)
     Vector3 originalNormal; // Original normal at the intersection (before any transformations)
-    std::shared_ptr<Shape> object; // Pointer to the intersected object (mainly for debugging purposes)
+    const Shape* object;    // The intersected object (mainly for debugging purposes); owned by the scene
     Material material;      // Material of the intersected object
+    int objectIndex;        // Position of object in the scene's object list, -1 if unknown
+    int primitive;          // Triangle or sphere within the object, 0 for single shapes
 
-    Intersection() : hit(false) {}
-    Intersection(const Vector3& point, const Vector3& normal, const std::shared_ptr<Shape>& obj)
-            : hit(true), point(point), normal(normal), originalPoint(point), originalNormal(normal), object(obj), material(obj->material) {}
+    Intersection() : hit(false), object(nullptr), objectIndex(-1), primitive(0) {}
+    Intersection(const Vector3& point, const Vector3& normal, const Shape* obj)
+            : hit(true), point(point), normal(normal), originalPoint(point), originalNormal(normal), object(obj), material(obj->material),
+              objectIndex(-1), primitive(0) {}
 
     // Conversion to bool to check if an intersection occurred
     operator bool() const {
@@ -44,7 +47,7 @@ public:
         return originalNormal;
     }
 
-    std::shared_ptr<Shape> getObject() const {
+    const Shape* getObject() const {
         return object;
     }
 
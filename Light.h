@@ -5,19 +5,30 @@
 #ifndef RAY_TRACER_LIGHT_H
 #define RAY_TRACER_LIGHT_H
 
+#include <algorithm>
+#include <cmath>
+#include <memory>
 #include <sstream>
 
+#include "BoundingBox.h"
+
 class Light {
 public:
     enum class Type {
         Directional,
-        Point
+        Point,
+        Quad,   // Parallelogram spanned by two edges from a corner
+        Disk,
+        Sphere
     };
 
-    Vector3 direction; // Normalized direction of the light (for directional)
-    Vector3 position;  // Position of the light (for point)
+    Vector3 direction; // Normalized direction of the light (for directional), normal of a disk light
+    Vector3 position;  // Position of the light (for point), corner of a quad, center of a disk or sphere
     Vector3 color;     // Color intensity
     Type type;
+    Vector3 edge1, edge2; // Edges of a quad light
+    float radius = 0.0f;  // Radius of a disk or sphere light
+    int samples = 1;      // Shadow rays per shading point for area lights
 
     Light(Type type, const Vector3& directionOrPosition, const Vector3& color)
             : color(color), type(type) {
@@ -28,24 +39,134 @@ public:
         }
     }
 
+    static std::shared_ptr<Light> makeQuad(const Vector3& corner, const Vector3& edge1, const Vector3& edge2,
+                                           const Vector3& color, int samples) {
+        std::shared_ptr<Light> light = std::make_shared<Light>(Type::Quad, corner, color);
+        light->edge1 = edge1;
+        light->edge2 = edge2;
+        light->samples = std::max(1, samples);
+        return light;
+    }
+
+    static std::shared_ptr<Light> makeDisk(const Vector3& center, const Vector3& normal, float radius,
+                                           const Vector3& color, int samples) {
+        std::shared_ptr<Light> light = std::make_shared<Light>(Type::Disk, center, color);
+        light->direction = normal.normalize();
+        light->radius = radius;
+        light->samples = std::max(1, samples);
+        return light;
+    }
+
+    static std::shared_ptr<Light> makeSphere(const Vector3& center, float radius, const Vector3& color, int samples) {
+        std::shared_ptr<Light> light = std::make_shared<Light>(Type::Sphere, center, color);
+        light->radius = radius;
+        light->samples = std::max(1, samples);
+        return light;
+    }
+
+    bool isArea() const {
+        return type == Type::Quad || type == Type::Disk || type == Type::Sphere;
+    }
+
+    // Point on an area light for the sample (u, v) in [0, 1)^2. Stratified (u, v) give stratified points.
+    // A sphere is sampled on its silhouette as seen from the shading point: the circle where the tangent
+    // cone from that point touches the sphere, which lies r^2/d from the center and has radius
+    // r * sqrt(1 - r^2/d^2) at distance d. From inside the sphere it falls back to the disk through the center.
+    Vector3 samplePoint(const Vector3& from, float u, float v) const {
+        if (type == Type::Quad) {
+            return position + edge1 * u + edge2 * v;
+        }
+        Vector3 center = position;
+        Vector3 normal = direction;
+        float diskRadius = radius;
+        if (type == Type::Sphere) {
+            Vector3 toPoint = from - position;
+            float distance = toPoint.length();
+            normal = distance > 0.0f ? toPoint / distance : Vector3(0, 0, 1);
+            if (distance > radius) {
+                float ratio = radius / distance;
+                center = position + normal * (radius * ratio);
+                diskRadius = radius * std::sqrt(1.0f - ratio * ratio);
+            }
+        }
+        Vector3 s, t;
+        basis(normal, s, t);
+        float dx, dy;
+        concentricDisk(u, v, dx, dy);
+        return center + (s * dx + t * dy) * diskRadius;
+    }
+
+    // Box containing every point the light can emit from
+    BoundingBox bounds() const {
+        BoundingBox box;
+        if (type == Type::Quad) {
+            box.expand(position);
+            box.expand(position + edge1);
+            box.expand(position + edge2);
+            box.expand(position + edge1 + edge2);
+        } else {
+            box.expand(position - Vector3(radius, radius, radius));
+            box.expand(position + Vector3(radius, radius, radius));
+        }
+        return box;
+    }
+
     std::string toString() const {
         std::ostringstream oss;
         if (type == Type::Directional) {
             oss << "Directional Light with direction (" << direction.x << ", " << direction.y << ", " << direction.z << ")";
-        } else {
+        } else if (type == Type::Point) {
             oss << "Point Light with position (" << position.x << ", " << position.y << ", " << position.z << ")";
+        } else if (type == Type::Quad) {
+            oss << "Quad Light with corner " << position << ", edges " << edge1 << " and " << edge2 << ", "
+                << samples << " samples";
+        } else {
+            oss << (type == Type::Disk ? "Disk" : "Sphere") << " Light with center " << position << ", radius "
+                << radius << ", " << samples << " samples";
         }
         oss << " and color intensity (" << color.x << ", " << color.y << ", " << color.z << ")";
         return oss.str();
     }
 
+private:
+    // Orthonormal tangents of a unit normal (Duff et al. 2017)
+    static void basis(const Vector3& n, Vector3& s, Vector3& t) {
+        float sign = std::copysign(1.0f, n.z);
+        float a = -1.0f / (sign + n.z);
+        float b = n.x * n.y * a;
+        s = Vector3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+        t = Vector3(b, sign + n.y * n.y * a, -n.y);
+    }
+
+    // Shirley-Chiu mapping of the unit square onto the unit disk, which keeps strata compact
+    static void concentricDisk(float u, float v, float& x, float& y) {
+        float a = 2.0f * u - 1.0f, b = 2.0f * v - 1.0f;
+        if (a == 0.0f && b == 0.0f) {
+            x = y = 0.0f;
+            return;
+        }
+        float r, phi;
+        if (std::fabs(a) > std::fabs(b)) {
+            r = a;
+            phi = static_cast<float>(M_PI / 4) * (b / a);
+        } else {
+            r = b;
+            phi = static_cast<float>(M_PI / 2) - static_cast<float>(M_PI / 4) * (a / b);
+        }
+        x = r * std::cos(phi);
+        y = r * std::sin(phi);
+    }
 };
 
 bool operator==(const Light& lhs, const Light& rhs) {
     return lhs.type == rhs.type &&
            lhs.direction == rhs.direction &&
            lhs.position == rhs.position &&
-           lhs.color == rhs.color;
+           lhs.color == rhs.color &&
+           lhs.edge1 == rhs.edge1 &&
+           lhs.edge2 == rhs.edge2 &&
+           lhs.radius == rhs.radius &&
+           lhs.samples == rhs.samples;
 }
 
 #endif //RAY_TRACER_LIGHT_H
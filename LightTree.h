@@ -0,0 +1,131 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_LIGHTTREE_H
+#define RAY_TRACER_LIGHTTREE_H
+
+#include <vector>
+
+#include "BoundingBox.h"
+#include "RenderStats.h"
+#include "Scene.h"
+
+// Bounding volume hierarchy over the scene's point and area lights. Each node stores the spatial extent of its
+// lights and the brightest light inside it, which bounds how much any light in the subtree can contribute
+// at a given distance. Whole clusters of distant, attenuated lights can then be skipped with one test.
+class LightTree {
+public:
+    struct Node {
+        BoundingBox bounds;
+        float maxPower;  // Largest color channel of any light in the subtree
+        int left, right; // Child node indices, -1 for leaves
+        int first, count; // Range in lightIndices covered by this node
+    };
+
+    int leafSize = 4; // Maximum number of lights per leaf
+
+    LightTree() = default;
+
+    void build(const Scene& scene) {
+        nodes.clear();
+        lightIndices.clear();
+        directionalIndices.clear();
+
+        for (size_t i = 0; i < scene.lights.size(); i++) {
+            if (scene.lights[i]->type != Light::Type::Directional) {
+                lightIndices.push_back(i);
+            } else {
+                directionalIndices.push_back(i); // Directional lights are unattenuated, so never culled
+            }
+        }
+        if (!lightIndices.empty()) {
+            buildNode(scene, 0, static_cast<int>(lightIndices.size()));
+        }
+    }
+
+    // Appends the indices of every light that can contribute at least cutoff at the given point.
+    // Culling is conservative per light: anything left out is dimmer than cutoff after attenuation.
+    void collect(const Scene& scene, const Vector3& point, float cutoff, std::vector<size_t>& out) const {
+        out.insert(out.end(), directionalIndices.begin(), directionalIndices.end());
+        if (nodes.empty()) return;
+
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            const Node& node = nodes[stack[--stackSize]];
+            RT_STAT(nodeVisits, 1);
+            if (node.maxPower * attenuationAt(scene, node.bounds.distanceTo(point)) < cutoff) continue;
+
+            if (node.left < 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    const std::shared_ptr<Light>& light = scene.lights[lightIndices[i]];
+                    float attenuation = light->isArea() ? attenuationAt(scene, light->bounds().distanceTo(point))
+                                                        : scene.attenuation(point, light);
+                    if (power(*light) * attenuation >= cutoff) {
+                        out.push_back(lightIndices[i]);
+                    }
+                }
+            } else {
+                stack[stackSize++] = node.left;
+                stack[stackSize++] = node.right;
+            }
+        }
+    }
+
+    size_t nodeCount() const {
+        return nodes.size();
+    }
+
+private:
+    std::vector<Node> nodes;
+    std::vector<size_t> lightIndices;       // Point and area lights, reordered so every node covers a contiguous range
+    std::vector<size_t> directionalIndices; // Always returned by collect()
+
+    static float power(const Light& light) {
+        return std::max(light.color.x, std::max(light.color.y, light.color.z));
+    }
+
+    static float attenuationAt(const Scene& scene, float distance) {
+        return scene.constantAttenuation / (scene.constantAttenuation + scene.linearAttenuation * distance +
+                                            scene.quadraticAttenuation * distance * distance);
+    }
+
+    int buildNode(const Scene& scene, int first, int count) {
+        int index = static_cast<int>(nodes.size());
+        nodes.push_back(Node());
+
+        Node node;
+        node.first = first;
+        node.count = count;
+        node.left = node.right = -1;
+        node.maxPower = 0.0f;
+        BoundingBox centroidBounds;
+        for (int i = first; i < first + count; i++) {
+            const Light& light = *scene.lights[lightIndices[i]];
+            node.bounds.expand(light.bounds()); // Area lights cover their whole extent, so culling stays conservative
+            centroidBounds.expand(light.bounds().centroid());
+            node.maxPower = std::max(node.maxPower, power(light));
+        }
+
+        if (count > leafSize) {
+            // Median split along the longest axis keeps the tree balanced for arbitrary light layouts
+            int axis = centroidBounds.longestAxis();
+            int mid = first + count / 2;
+            std::nth_element(lightIndices.begin() + first, lightIndices.begin() + mid, lightIndices.begin() + first + count,
+                             [&](size_t a, size_t b) {
+                                 return axisOf(scene.lights[a]->bounds().centroid(), axis) <
+                                        axisOf(scene.lights[b]->bounds().centroid(), axis);
+                             });
+            node.left = buildNode(scene, first, mid - first);
+            node.right = buildNode(scene, mid, first + count - mid);
+        }
+
+        nodes[index] = node;
+        return index;
+    }
+};
+
+
+#endif //RAY_TRACER_LIGHTTREE_H
@@ -0,0 +1,146 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_MESH_H
+#define RAY_TRACER_MESH_H
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include "BVH.h"
+#include "Shape.h"
+
+// Triangle mesh stored as one shared vertex buffer plus three vertex indices per triangle, instead of a
+// Triangle object per face. The mesh is a single object in the scene's BVH and keeps its own BVH over its
+// triangles. Like Triangle, vertices are in world space (the transform is applied when loading).
+class Mesh final : public Shape {
+public:
+    std::vector<Vector3> vertices;
+    std::vector<uint32_t> indices; // 3 per triangle
+
+    Mesh(std::vector<Vector3> vertices, std::vector<uint32_t> indices, const Material& material)
+            : Shape(material, ShapeType::Mesh), vertices(std::move(vertices)), indices(std::move(indices)) {
+        std::vector<BoundingBox> triangleBounds(triangleCount());
+        for (size_t i = 0; i < triangleBounds.size(); i++) {
+            triangleBounds[i].expand(vertex(i, 0));
+            triangleBounds[i].expand(vertex(i, 1));
+            triangleBounds[i].expand(vertex(i, 2));
+            meshBounds.expand(triangleBounds[i]);
+        }
+        bvh.build(triangleBounds);
+    }
+
+    size_t triangleCount() const {
+        return indices.size() / 3;
+    }
+
+    bool intersect(const Ray& ray, float& t) const override {
+        int primitive;
+        return intersectPrimitive(ray, t, primitive);
+    }
+
+    bool intersectAny(const Ray& ray, float& t) const override {
+        bool found = false;
+        bvh.traverse(ray, t, [&](int triangle, float& maxDistance) {
+            float hit;
+            RT_STAT(primitiveTests, 1);
+            if (intersectTriangle(ray, triangle, hit) && hit < maxDistance) {
+                t = hit;
+                found = true;
+                return true; // Any occluder will do
+            }
+            return false;
+        });
+        return found;
+    }
+
+    bool intersectPrimitive(const Ray& ray, float& t, int& primitive) const override {
+        float closest = std::numeric_limits<float>::max();
+        primitive = -1;
+        bvh.traverse(ray, closest, [&](int triangle, float& maxDistance) {
+            float hit;
+            RT_STAT(primitiveTests, 1);
+            if (intersectTriangle(ray, triangle, hit) && hit < maxDistance) {
+                maxDistance = hit;
+                closest = hit;
+                primitive = triangle;
+            }
+            return false;
+        });
+        t = closest;
+        return primitive >= 0;
+    }
+
+    Vector3 normalAtPrimitive(const Vector3& point, int primitive) const override {
+        (void)point; // Flat shading, like Triangle
+        Vector3 edge1 = vertex(primitive, 1) - vertex(primitive, 0);
+        Vector3 edge2 = vertex(primitive, 2) - vertex(primitive, 0);
+        return edge1.cross(edge2).normalize();
+    }
+
+    // Without the primitive id, the triangle whose plane is closest to the point is looked up. Slow; the
+    // scene always goes through normalAtPrimitive.
+    Vector3 normalAt(const Vector3& point) const override {
+        int best = 0;
+        float bestDistance = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < triangleCount(); i++) {
+            Vector3 normal = normalAtPrimitive(point, static_cast<int>(i));
+            float distance = std::abs((point - vertex(i, 0)).dot(normal));
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = static_cast<int>(i);
+            }
+        }
+        return normalAtPrimitive(point, best);
+    }
+
+    BoundingBox bounds() const override {
+        return meshBounds;
+    }
+
+    std::string toString() const override {
+        std::ostringstream oss;
+        oss << "Mesh with " << vertices.size() << " vertices and " << triangleCount() << " triangles\n"
+            << Shape::toString();
+        return oss.str();
+    }
+
+private:
+    BVH bvh; // Over triangles
+    BoundingBox meshBounds;
+
+    const Vector3& vertex(size_t triangle, int corner) const {
+        return vertices[indices[triangle * 3 + corner]];
+    }
+
+    // Moller-Trumbore, two-sided like Triangle::intersect. The determinant scales with the edge and direction
+    // lengths, so the parallel test is relative to them and works for triangles of any size.
+    bool intersectTriangle(const Ray& ray, int triangle, float& t) const {
+        const float EPSILON = 1e-6f;
+        const Vector3& v0 = vertex(triangle, 0);
+        Vector3 edge1 = vertex(triangle, 1) - v0;
+        Vector3 edge2 = vertex(triangle, 2) - v0;
+        Vector3 p = ray.direction.cross(edge2);
+        float determinant = edge1.dot(p);
+        float scale = edge1.dot(edge1) * edge2.dot(edge2) * ray.direction.dot(ray.direction);
+        if (determinant * determinant <= EPSILON * EPSILON * scale) return false; // Ray is parallel to the triangle
+        float inverseDeterminant = 1.0f / determinant;
+
+        Vector3 s = ray.origin - v0;
+        float u = s.dot(p) * inverseDeterminant;
+        if (u < 0.0f || u > 1.0f) return false;
+        Vector3 q = s.cross(edge1);
+        float v = ray.direction.dot(q) * inverseDeterminant;
+        if (v < 0.0f || u + v > 1.0f) return false;
+
+        t = edge2.dot(q) * inverseDeterminant;
+        return t >= 0.0f;
+    }
+};
+
+
+#endif //RAY_TRACER_MESH_H
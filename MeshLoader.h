@@ -0,0 +1,524 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_MESHLOADER_H
+#define RAY_TRACER_MESHLOADER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Matrix4x4.h"
+#include "ThreadPool.h"
+#include "Vector3.h"
+
+// Reads triangle meshes from Wavefront OBJ and binary PLY files straight into a shared vertex buffer and an
+// index buffer (three indices per triangle). Files are memory-mapped, so the data is never copied into
+// intermediate strings. OBJ files are parsed in independent chunks split at line boundaries, binary PLY
+// vertex and face records are decoded in parallel ranges. Polygons are triangulated as fans; only
+// positions are read (normals and texture coordinates are ignored). Errors throw std::runtime_error.
+class MeshLoader {
+public:
+    std::vector<Vector3> vertices;
+    std::vector<uint32_t> indices;
+    size_t bytesRead = 0;
+
+    // transform is applied to every vertex while loading
+    void load(const std::string& filename, const Matrix4x4& transform, ThreadPool* pool = nullptr) {
+        MappedFile file(filename);
+        bytesRead = file.size;
+        std::string extension = filename.substr(filename.find_last_of('.') + 1);
+        for (char& c : extension) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        if (extension == "obj") {
+            loadObj(file.data, file.data + file.size, pool);
+        } else if (extension == "ply") {
+            loadPly(file.data, file.data + file.size, pool);
+        } else {
+            throw std::runtime_error("Unknown mesh format: " + filename);
+        }
+
+        ParallelErrors errors;
+        forRanges(vertices.size(), pool, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                vertices[i] = transform * vertices[i];
+            }
+        });
+        forRanges(indices.size(), pool, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                if (indices[i] >= vertices.size()) {
+                    errors.set("Vertex index out of range in " + filename);
+                    return;
+                }
+            }
+        });
+        errors.rethrow();
+    }
+
+private:
+    // Read-only mapping of a whole file
+    struct MappedFile {
+        const char* data = nullptr;
+        size_t size = 0;
+
+        explicit MappedFile(const std::string& filename) {
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Unable to open mesh " + filename);
+            }
+            struct stat info;
+            if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+                size = static_cast<size_t>(info.st_size);
+                void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    data = static_cast<const char*>(mapping);
+                    ::madvise(mapping, size, MADV_SEQUENTIAL);
+                }
+            }
+            ::close(fd); // The mapping stays valid
+            if (data == nullptr) {
+                throw std::runtime_error("Unable to map mesh " + filename);
+            }
+        }
+
+        ~MappedFile() {
+            ::munmap(const_cast<char*>(data), size);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+    };
+
+    // Pool workers must not throw, so they record the first error and the caller rethrows it
+    struct ParallelErrors {
+        std::mutex mutex;
+        std::string message;
+
+        void set(const std::string& error) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (message.empty()) message = error;
+        }
+
+        void rethrow() {
+            if (!message.empty()) throw std::runtime_error(message);
+        }
+    };
+
+    // Calls body(begin, end) on consecutive ranges covering [0, count), on the pool's workers if given
+    template <typename Body>
+    static void forRanges(size_t count, ThreadPool* pool, Body body) {
+        const size_t rangeSize = 1 << 16;
+        int ranges = static_cast<int>((count + rangeSize - 1) / rangeSize);
+        if (pool == nullptr || ranges <= 1) {
+            body(0, count);
+            return;
+        }
+        pool->parallelFor(ranges, [&](int range, int) {
+            body(range * rangeSize, std::min(count, (range + 1) * rangeSize));
+        });
+    }
+
+    // ---------------------------------------------------------------- OBJ
+
+    struct ObjChunk {
+        std::vector<Vector3> vertices;
+        std::vector<uint32_t> indices;       // Absolute indices, or chunk-local ones for relative references
+        std::vector<size_t> relativeIndices; // Positions in indices that still need the chunk's vertex offset
+        std::string error;
+    };
+
+    void loadObj(const char* begin, const char* end, ThreadPool* pool) {
+        // Chunks end at line breaks so no line is split
+        int chunkCount = pool != nullptr ? std::max(1, pool->size() * 4) : 1;
+        std::vector<const char*> bounds(chunkCount + 1, end);
+        bounds[0] = begin;
+        for (int i = 1; i < chunkCount; i++) {
+            const char* p = std::max(bounds[i - 1], begin + (end - begin) * i / chunkCount);
+            while (p < end && *p != '\n') p++;
+            bounds[i] = p < end ? p + 1 : end;
+        }
+
+        std::vector<ObjChunk> chunks(chunkCount);
+        auto parse = [&](int i, int) { parseObjChunk(bounds[i], bounds[i + 1], chunks[i]); };
+        if (pool != nullptr) {
+            pool->parallelFor(chunkCount, parse);
+        } else {
+            parse(0, 0);
+        }
+
+        std::vector<size_t> vertexOffsets(chunkCount + 1, 0), indexOffsets(chunkCount + 1, 0);
+        for (int i = 0; i < chunkCount; i++) {
+            if (!chunks[i].error.empty()) throw std::runtime_error(chunks[i].error);
+            vertexOffsets[i + 1] = vertexOffsets[i] + chunks[i].vertices.size();
+            indexOffsets[i + 1] = indexOffsets[i] + chunks[i].indices.size();
+        }
+        vertices.resize(vertexOffsets[chunkCount]);
+        indices.resize(indexOffsets[chunkCount]);
+
+        auto gather = [&](int i, int) {
+            ObjChunk& chunk = chunks[i];
+            std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + vertexOffsets[i]);
+            for (size_t position : chunk.relativeIndices) {
+                chunk.indices[position] += static_cast<uint32_t>(vertexOffsets[i]);
+            }
+            std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + indexOffsets[i]);
+            std::vector<Vector3>().swap(chunk.vertices); // Release as we go, halving peak memory
+            std::vector<uint32_t>().swap(chunk.indices);
+        };
+        if (pool != nullptr) {
+            pool->parallelFor(chunkCount, gather);
+        } else {
+            gather(0, 0);
+        }
+    }
+
+    static void parseObjChunk(const char* p, const char* end, ObjChunk& chunk) {
+        std::vector<int64_t> polygon;
+        std::vector<bool> polygonRelative;
+        while (p < end) {
+            skipSpaces(p, end);
+            if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                p += 2;
+                Vector3 v;
+                bool ok = parseFloat(p, end, v.x) && parseFloat(p, end, v.y) && parseFloat(p, end, v.z);
+                if (!ok) {
+                    chunk.error = "Malformed OBJ vertex";
+                    return;
+                }
+                chunk.vertices.push_back(v);
+            } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                p += 2;
+                polygon.clear();
+                polygonRelative.clear();
+                while (true) {
+                    skipSpaces(p, end);
+                    if (p >= end || *p == '\n' || *p == '\r' || *p == '#') break;
+                    long long index;
+                    if (!parseInt(p, end, index) || index == 0) {
+                        chunk.error = "Malformed OBJ face";
+                        return;
+                    }
+                    while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++; // Skip /vt/vn
+                    bool relative = index < 0;
+                    polygon.push_back(relative ? static_cast<int64_t>(chunk.vertices.size()) + index : index - 1);
+                    polygonRelative.push_back(relative);
+                }
+                for (size_t i = 1; i + 1 < polygon.size(); i++) {
+                    size_t corners[3] = {0, i, i + 1};
+                    for (size_t corner : corners) {
+                        if (polygonRelative[corner]) {
+                            chunk.relativeIndices.push_back(chunk.indices.size());
+                        }
+                        chunk.indices.push_back(static_cast<uint32_t>(polygon[corner]));
+                    }
+                }
+            }
+            while (p < end && *p != '\n') p++; // Anything else (vn, vt, g, usemtl, comments) is skipped
+            p++;
+        }
+    }
+
+    static void skipSpaces(const char*& p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+    }
+
+    static bool parseInt(const char*& p, const char* end, long long& value) {
+        bool negative = p < end && *p == '-';
+        if (negative || (p < end && *p == '+')) p++;
+        if (p >= end || *p < '0' || *p > '9') return false;
+        value = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            value = value * 10 + (*p++ - '0');
+        }
+        if (negative) value = -value;
+        return true;
+    }
+
+    // Bounded replacement for strtof: the mapped file isn't null-terminated
+    static bool parseFloat(const char*& p, const char* end, float& value) {
+        skipSpaces(p, end);
+        bool negative = p < end && *p == '-';
+        if (negative || (p < end && *p == '+')) p++;
+        double mantissa = 0.0;
+        int exponent = 0;
+        bool digits = false;
+        while (p < end && *p >= '0' && *p <= '9') {
+            mantissa = mantissa * 10.0 + (*p++ - '0');
+            digits = true;
+        }
+        if (p < end && *p == '.') {
+            p++;
+            while (p < end && *p >= '0' && *p <= '9') {
+                mantissa = mantissa * 10.0 + (*p++ - '0');
+                exponent--;
+                digits = true;
+            }
+        }
+        if (!digits) return false;
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            long long power;
+            if (!parseInt(p, end, power)) return false;
+            exponent += static_cast<int>(power);
+        }
+        double result = mantissa * std::pow(10.0, exponent);
+        value = static_cast<float>(negative ? -result : result);
+        return true;
+    }
+
+    // ---------------------------------------------------------------- PLY
+
+    enum PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+    struct PlyProperty {
+        std::string name;
+        PlyType type;
+        bool isList = false;
+        PlyType countType = UInt8;
+    };
+
+    struct PlyElement {
+        std::string name;
+        size_t count = 0;
+        std::vector<PlyProperty> properties;
+    };
+
+    static PlyType plyType(const std::string& name) {
+        if (name == "char" || name == "int8") return Int8;
+        if (name == "uchar" || name == "uint8") return UInt8;
+        if (name == "short" || name == "int16") return Int16;
+        if (name == "ushort" || name == "uint16") return UInt16;
+        if (name == "int" || name == "int32") return Int32;
+        if (name == "uint" || name == "uint32") return UInt32;
+        if (name == "float" || name == "float32") return Float32;
+        if (name == "double" || name == "float64") return Float64;
+        throw std::runtime_error("Unknown PLY property type " + name);
+    }
+
+    static size_t plySize(PlyType type) {
+        static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+        return sizes[type];
+    }
+
+    static double readPly(const char* p, PlyType type, bool swap) {
+        unsigned char bytes[8];
+        size_t size = plySize(type);
+        std::memcpy(bytes, p, size);
+        if (swap) std::reverse(bytes, bytes + size);
+        switch (type) {
+            case Int8: return static_cast<int8_t>(bytes[0]);
+            case UInt8: return bytes[0];
+            case Int16: { int16_t v; std::memcpy(&v, bytes, 2); return v; }
+            case UInt16: { uint16_t v; std::memcpy(&v, bytes, 2); return v; }
+            case Int32: { int32_t v; std::memcpy(&v, bytes, 4); return v; }
+            case UInt32: { uint32_t v; std::memcpy(&v, bytes, 4); return v; }
+            case Float32: { float v; std::memcpy(&v, bytes, 4); return v; }
+            default: { double v; std::memcpy(&v, bytes, 8); return v; }
+        }
+    }
+
+    // Size of one record, or 0 if the element has list properties (variable size)
+    static size_t fixedStride(const PlyElement& element) {
+        size_t stride = 0;
+        for (const PlyProperty& property : element.properties) {
+            if (property.isList) return 0;
+            stride += plySize(property.type);
+        }
+        return stride;
+    }
+
+    // Walks one variable-size record and returns its size
+    static size_t recordSize(const PlyElement& element, const char* p, const char* end, bool swap) {
+        size_t size = 0;
+        for (const PlyProperty& property : element.properties) {
+            if (p + size + plySize(property.countType) > end) throw std::runtime_error("PLY file is truncated");
+            if (property.isList) {
+                size_t count = static_cast<size_t>(readPly(p + size, property.countType, swap));
+                size += plySize(property.countType) + count * plySize(property.type);
+            } else {
+                size += plySize(property.type);
+            }
+        }
+        return size;
+    }
+
+    void loadPly(const char* begin, const char* end, ThreadPool* pool) {
+        // Header: text lines up to "end_header"
+        static const char marker[] = "end_header";
+        const char* headerEnd = std::search(begin, end, marker, marker + sizeof(marker) - 1);
+        if (headerEnd == end) throw std::runtime_error("PLY header has no end_header");
+        while (headerEnd < end && *headerEnd != '\n') headerEnd++;
+        if (headerEnd < end) headerEnd++;
+        std::istringstream header(std::string(begin, headerEnd));
+        std::string line, format;
+        std::vector<PlyElement> elements;
+        while (std::getline(header, line)) {
+            std::istringstream iss(line);
+            std::string keyword;
+            iss >> keyword;
+            if (keyword == "format") {
+                iss >> format;
+            } else if (keyword == "element") {
+                elements.push_back(PlyElement());
+                iss >> elements.back().name >> elements.back().count;
+            } else if (keyword == "property" && !elements.empty()) {
+                PlyProperty property;
+                std::string type;
+                iss >> type;
+                if (type == "list") {
+                    std::string countType, itemType;
+                    iss >> countType >> itemType;
+                    property.isList = true;
+                    property.countType = plyType(countType);
+                    property.type = plyType(itemType);
+                } else {
+                    property.type = plyType(type);
+                }
+                iss >> property.name;
+                elements.back().properties.push_back(property);
+            }
+        }
+        if (format != "binary_little_endian" && format != "binary_big_endian") {
+            throw std::runtime_error("Only binary PLY files are supported, this one is " + format);
+        }
+        uint16_t probe = 1;
+        bool littleEndianHost = *reinterpret_cast<unsigned char*>(&probe) == 1;
+        bool swap = (format == "binary_little_endian") != littleEndianHost;
+
+        const char* p = headerEnd;
+        for (const PlyElement& element : elements) {
+            if (element.name == "vertex") {
+                p = readPlyVertices(element, p, end, swap, pool);
+            } else if (element.name == "face") {
+                p = readPlyFaces(element, p, end, swap, pool);
+            } else {
+                size_t stride = fixedStride(element);
+                for (size_t i = 0; i < element.count; i++) {
+                    p += stride > 0 ? stride : recordSize(element, p, end, swap);
+                }
+            }
+            if (p > end) throw std::runtime_error("PLY file is truncated");
+        }
+    }
+
+    const char* readPlyVertices(const PlyElement& element, const char* p, const char* end, bool swap,
+                                ThreadPool* pool) {
+        size_t stride = fixedStride(element);
+        if (stride == 0) throw std::runtime_error("PLY vertices with list properties are not supported");
+        if (static_cast<size_t>(end - p) < element.count * stride) throw std::runtime_error("PLY file is truncated");
+
+        size_t offsets[3] = {0, 0, 0};
+        PlyType types[3] = {Float32, Float32, Float32};
+        int found = 0;
+        size_t offset = 0;
+        for (const PlyProperty& property : element.properties) {
+            int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+            if (axis >= 0) {
+                offsets[axis] = offset;
+                types[axis] = property.type;
+                found++;
+            }
+            offset += plySize(property.type);
+        }
+        if (found != 3) throw std::runtime_error("PLY vertices need x, y and z");
+
+        vertices.resize(element.count);
+        forRanges(element.count, pool, [&](size_t rangeBegin, size_t rangeEnd) {
+            for (size_t i = rangeBegin; i < rangeEnd; i++) {
+                const char* record = p + i * stride;
+                vertices[i] = Vector3(static_cast<float>(readPly(record + offsets[0], types[0], swap)),
+                                      static_cast<float>(readPly(record + offsets[1], types[1], swap)),
+                                      static_cast<float>(readPly(record + offsets[2], types[2], swap)));
+            }
+        });
+        return p + element.count * stride;
+    }
+
+    const char* readPlyFaces(const PlyElement& element, const char* p, const char* end, bool swap,
+                             ThreadPool* pool) {
+        // Locate the index list; any other properties are skipped
+        int listProperty = -1;
+        size_t before = 0, after = 0;
+        for (size_t i = 0; i < element.properties.size(); i++) {
+            const PlyProperty& property = element.properties[i];
+            if (property.isList && (property.name == "vertex_indices" || property.name == "vertex_index") &&
+                listProperty < 0) {
+                listProperty = static_cast<int>(i);
+            } else if (property.isList) {
+                before = after = std::string::npos; // Another list: records vary in size in other ways too
+                break;
+            } else if (listProperty < 0) {
+                before += plySize(property.type);
+            } else {
+                after += plySize(property.type);
+            }
+        }
+        if (listProperty < 0) throw std::runtime_error("PLY faces need a vertex_indices list");
+        const PlyProperty& list = element.properties[listProperty];
+        size_t countSize = plySize(list.countType), indexSize = plySize(list.type);
+
+        // Fast path: if every face is a triangle, records have a fixed size and decode in parallel
+        if (before != std::string::npos) {
+            size_t stride = before + countSize + 3 * indexSize + after;
+            std::atomic<bool> allTriangles(static_cast<size_t>(end - p) >= element.count * stride);
+            if (allTriangles) {
+                forRanges(element.count, pool, [&](size_t rangeBegin, size_t rangeEnd) {
+                    for (size_t i = rangeBegin; i < rangeEnd && allTriangles; i++) {
+                        if (readPly(p + i * stride + before, list.countType, swap) != 3) allTriangles = false;
+                    }
+                });
+            }
+            if (allTriangles) {
+                indices.resize(element.count * 3);
+                forRanges(element.count, pool, [&](size_t rangeBegin, size_t rangeEnd) {
+                    for (size_t i = rangeBegin; i < rangeEnd; i++) {
+                        const char* item = p + i * stride + before + countSize;
+                        for (int corner = 0; corner < 3; corner++) {
+                            indices[i * 3 + corner] =
+                                    static_cast<uint32_t>(readPly(item + corner * indexSize, list.type, swap));
+                        }
+                    }
+                });
+                return p + element.count * stride;
+            }
+        }
+
+        // General case: walk the records in order and triangulate polygons as fans
+        for (size_t i = 0; i < element.count; i++) {
+            const char* record = p;
+            size_t size = recordSize(element, record, end, swap);
+            if (record + size > end) throw std::runtime_error("PLY file is truncated");
+            const char* field = record;
+            for (int j = 0; j < listProperty; j++) {
+                field += element.properties[j].isList ? 0 : plySize(element.properties[j].type);
+            }
+            size_t count = static_cast<size_t>(readPly(field, list.countType, swap));
+            const char* item = field + countSize;
+            for (size_t k = 1; k + 1 < count; k++) {
+                indices.push_back(static_cast<uint32_t>(readPly(item, list.type, swap)));
+                indices.push_back(static_cast<uint32_t>(readPly(item + k * indexSize, list.type, swap)));
+                indices.push_back(static_cast<uint32_t>(readPly(item + (k + 1) * indexSize, list.type, swap)));
+            }
+            p = record + size;
+        }
+        return p;
+    }
+};
+
+
+#endif //RAY_TRACER_MESHLOADER_H
@@ -7,9 +7,11 @@
 
 #include "Scene.h"
 #include "Sphere.h"
-#include "Triangle.h"
+#include "Mesh.h"
+#include "MeshLoader.h"
 #include "Material.h"
 #include "Transform.h"
+#include "Timeline.h"
 
 #include <iostream>
 #include <fstream>
@@ -17,6 +19,10 @@
 #include <vector>
 #include <string>
 #include <stack>
+#include <chrono>
+#include <memory>
+
+#include <sys/resource.h>
 
 class Parser {
 private:
@@ -31,27 +37,31 @@ private:
     Transform transform;
     std::stack<Transform> transformStack;  // Stack to store transformations
 
-    int vertexCount;
-    Vector3* vertices;
+    std::vector<Vector3> vertices;         // Object space, as given by vertex commands
+    std::vector<uint32_t> pendingTriangles; // tri commands not yet turned into a Mesh, 3 indices each
+    Material pendingMaterial;
+    Matrix4x4 pendingTransform;
+    std::vector<Sphere> pendingSpheres;
+    std::vector<std::string> meshFilenames; // Resolved paths of the files loaded by mesh commands
 public:
     Parser() : width(0), height(0), outputFilename(""), lookfromx(0), lookfromy(0), lookfromz(0), lookatx(0), lookaty(0),
                lookatz(0), upx(0), upy(0), upz(0), fov(0), constantAttenuation(1), linearAttenuation(0),
-               quadraticAttenuation(0), vertexCount(0), vertices(nullptr) {}
-
+               quadraticAttenuation(0) {}
 
-    ~Parser() {
-        if (vertices != nullptr) {
-            delete[] vertices;
-        }
-    }
-
-    Scene parseFile(const std::string& filename) {
+    // Mesh files are loaded in parallel on pool. Without one, parsing uses a pool of its own that is gone again
+    // by the time parseFile returns. Every call starts from a fresh state (material, transforms, vertices,
+    // attenuation), so a parser can be reused for several files.
+    Scene parseFile(const std::string& filename, ThreadPool* pool = nullptr) {
+        TimelineScope timelineScope("parse");
+        *this = Parser();
         std::cout << "Parsing file " << filename << std::endl;
         std::ifstream file(filename);
         if (!file.is_open()) {
             throw std::runtime_error("Unable to open file");
         }
         std::string line;
+        loadPool = pool;
+        std::unique_ptr<ThreadPool> ownPool;
 
         while (std::getline(file, line)) {
             std::istringstream iss(line);
@@ -68,6 +78,14 @@ public:
                 int maxDepth;
                 iss >> maxDepth;
                 scene.setMaxRecursionDepth(maxDepth);
+            } else if (command == "throughputepsilon") {
+                float epsilon;
+                iss >> epsilon;
+                scene.setThroughputEpsilon(epsilon);
+            } else if (command == "russianroulette") {
+                int depth;
+                iss >> depth;
+                scene.setRussianRouletteDepth(depth);
             } else if (command == "output") {
                 iss >> outputFilename;
             } else if (command == "camera") {
@@ -79,28 +97,48 @@ public:
             } else if (command == "sphere") {
                 float x, y, z, radius;
                 iss >> x >> y >> z >> radius;
-                auto sphere = std::make_shared<Sphere>(Vector3(x, y, z), radius, material);
-                sphere->setTransform(transform.getCurrentTransform());
-                scene.addObject(sphere);
+                Sphere sphere(Vector3(x, y, z), radius, material);
+                sphere.setTransform(transform.getCurrentTransform());
+                if (scene.spherePackingThreshold > 0) {
+                    pendingSpheres.push_back(sphere); // Added at the end, possibly packed into a SphereSet
+                } else {
+                    scene.addObject(scene.createObject<Sphere>(sphere)); // Straight into the arena, no second copy
+                }
             } else if (command == "maxverts") {
+                // Only a capacity hint now; the vertex buffer grows as needed
                 int maxverts;
                 iss >> maxverts;
-                vertices = new Vector3[maxverts];
+                if (maxverts > 0) {
+                    vertices.reserve(vertices.size() + maxverts);
+                }
             } else if (command == "vertex") {
                 float x, y, z;
                 iss >> x >> y >> z;
-                // Store vertex in vertices
-                vertices[vertexCount] = Vector3(x, y, z);
-                vertexCount++;
+                vertices.push_back(Vector3(x, y, z));
             } else if (command == "tri") {
-                int v1, v2, v3;
-                iss >> v1 >> v2 >> v3;
-                Vector3 transformedV1 = transform.getCurrentTransform() * vertices[v1];
-                Vector3 transformedV2 = transform.getCurrentTransform() * vertices[v2];
-                Vector3 transformedV3 = transform.getCurrentTransform() * vertices[v3];
-                auto triangle = std::make_shared<Triangle>(transformedV1, transformedV2, transformedV3, material);
-                triangle->setTransform(Matrix4x4());
-                scene.addObject(triangle);
+                long long v[3];
+                iss >> v[0] >> v[1] >> v[2];
+                for (long long index : v) {
+                    if (index < 0 || index >= static_cast<long long>(vertices.size())) {
+                        throw std::runtime_error("tri uses undefined vertex " + std::to_string(index));
+                    }
+                }
+                // Consecutive triangles with the same material and transform become one Mesh
+                if (!pendingTriangles.empty() &&
+                    !(material == pendingMaterial && transform.getCurrentTransform() == pendingTransform)) {
+                    flushTriangles(false);
+                }
+                pendingMaterial = material;
+                pendingTransform = transform.getCurrentTransform();
+                pendingTriangles.insert(pendingTriangles.end(), v, v + 3);
+            } else if (command == "mesh") {
+                std::string meshFilename;
+                iss >> meshFilename;
+                if (loadPool == nullptr) {
+                    ownPool.reset(new ThreadPool());
+                    loadPool = ownPool.get();
+                }
+                loadMesh(resolvePath(filename, meshFilename));
             } else if (command == "translate") {
                 float x, y, z;
                 iss >> x >> y >> z;
@@ -121,9 +159,39 @@ public:
                 float x, y, z, r, g, b;
                 iss >> x >> y >> z >> r >> g >> b;
                 scene.addLight(std::make_shared<Light>(Light::Type::Point, Vector3(x, y, z), Vector3(r, g, b)));
+            } else if (command == "quadlight") {
+                float x, y, z, r, g, b, ex, ey, ez, fx, fy, fz;
+                iss >> x >> y >> z >> ex >> ey >> ez >> fx >> fy >> fz >> r >> g >> b;
+                scene.addLight(Light::makeQuad(Vector3(x, y, z), Vector3(ex, ey, ez), Vector3(fx, fy, fz),
+                                               Vector3(r, g, b), readLightSamples(iss)));
+            } else if (command == "disklight") {
+                float x, y, z, r, g, b, nx, ny, nz, radius;
+                iss >> x >> y >> z >> nx >> ny >> nz >> radius >> r >> g >> b;
+                scene.addLight(Light::makeDisk(Vector3(x, y, z), Vector3(nx, ny, nz), radius, Vector3(r, g, b),
+                                               readLightSamples(iss)));
+            } else if (command == "spherelight") {
+                float x, y, z, r, g, b, radius;
+                iss >> x >> y >> z >> radius >> r >> g >> b;
+                scene.addLight(Light::makeSphere(Vector3(x, y, z), radius, Vector3(r, g, b), readLightSamples(iss)));
+            } else if (command == "adaptiveshadows") {
+                int samples;
+                iss >> samples;
+                scene.setAdaptiveShadowSamples(samples);
             } else if (command == "attenuation") {
                 iss >> constantAttenuation >> linearAttenuation >> quadraticAttenuation;
                 scene.setAttenuation(constantAttenuation, linearAttenuation, quadraticAttenuation);
+            } else if (command == "samplesperpixel") {
+                int samples;
+                iss >> samples;
+                scene.setSamplesPerPixel(samples);
+            } else if (command == "spherepacking") {
+                int threshold;
+                iss >> threshold;
+                scene.setSpherePackingThreshold(threshold);
+            } else if (command == "lightcutoff") {
+                float cutoff;
+                iss >> cutoff;
+                scene.setLightCutoff(cutoff);
             } else if (command == "ambient") {
                 float r, g, b;
                 iss >> r >> g >> b;
@@ -151,16 +219,116 @@ public:
             }
         }
 
+        flushTriangles(true);
+        loadPool = nullptr;
+        ownPool.reset();
+        if (scene.addSpheres(pendingSpheres)) {
+            std::cout << "Packed " << pendingSpheres.size() << " spheres into a SphereSet" << std::endl;
+        }
+        std::vector<Sphere>().swap(pendingSpheres);
         scene.setFovX();
         scene.updateVirtualScreen();
 
-        std::cout << "Successfully parsed file " << filename << std::endl;
-        return scene;
+        {
+            TimelineScope buildScope("build bvh");
+            scene.buildAccelerationStructure();
+        }
+        std::cout << "Built BVH with " << scene.bvh.nodeCount() << " nodes over " << scene.objects.size()
+                  << " objects (SAH cost " << scene.bvh.sahCost() << ")" << std::endl;
+        std::cout << "Scene arena: " << scene.arena->allocationCount() << " allocations, "
+                  << scene.arena->usedBytes() / 1024.0 << " KB used, " << scene.arena->reservedBytes() / 1024.0
+                  << " KB peak in " << scene.arena->blockCount() << " blocks" << std::endl;
+
+        std::cout << "Successfully parsed file " << filename << " (peak memory " << peakMemoryMegabytes()
+                  << " MB)" << std::endl;
+
+        // Hand the scene over by move; the parser keeps only what the getters report
+        Scene parsed(std::move(scene));
+        scene = Scene();
+        std::vector<Vector3>().swap(vertices);
+        return parsed;
     }
 
     std::string getOutputFilename() const {
         return outputFilename;
     }
+
+    // Mesh files the last parsed scene depends on, as opened (relative to the working directory)
+    const std::vector<std::string>& getMeshFilenames() const {
+        return meshFilenames;
+    }
+
+private:
+    ThreadPool* loadPool = nullptr; // Only set while parseFile runs
+
+    // Optional trailing shadow ray count of an area light, 16 by default
+    static int readLightSamples(std::istringstream& iss) {
+        int samples;
+        if (!(iss >> samples)) return 16;
+        return samples;
+    }
+
+    // Peak resident set size of the process so far
+    static double peakMemoryMegabytes() {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+        return usage.ru_maxrss / 1024.0; // Kilobytes on Linux
+    }
+
+    // Mesh paths are relative to the scene file
+    static std::string resolvePath(const std::string& sceneFilename, const std::string& path) {
+        size_t slash = sceneFilename.find_last_of('/');
+        if (path.empty() || path[0] == '/' || slash == std::string::npos) return path;
+        return sceneFilename.substr(0, slash + 1) + path;
+    }
+
+    // Adds the pending triangles as a Mesh, transformed to world space like the old per-triangle path. The
+    // last batch takes over the vertex buffer by move; earlier ones copy just the vertices they use, since
+    // later triangles may still refer to the rest (possibly under another transform).
+    void flushTriangles(bool last) {
+        if (pendingTriangles.empty()) return;
+        std::vector<Vector3> meshVertices;
+        if (last) {
+            meshVertices = std::move(vertices);
+            vertices.clear();
+            for (Vector3& vertex : meshVertices) {
+                vertex = pendingTransform * vertex;
+            }
+        } else {
+            std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+            for (uint32_t& index : pendingTriangles) {
+                if (remap[index] == UINT32_MAX) {
+                    remap[index] = static_cast<uint32_t>(meshVertices.size());
+                    meshVertices.push_back(pendingTransform * vertices[index]);
+                }
+                index = remap[index];
+            }
+        }
+        auto mesh = scene.createObject<Mesh>(std::move(meshVertices), std::move(pendingTriangles), pendingMaterial);
+        mesh->setTransform(Matrix4x4());
+        scene.addObject(mesh);
+        pendingTriangles.clear();
+    }
+
+    void loadMesh(const std::string& meshFilename) {
+        TimelineScope loadScope("load mesh");
+        meshFilenames.push_back(meshFilename);
+        auto start = std::chrono::steady_clock::now();
+        MeshLoader loader;
+        loader.load(meshFilename, transform.getCurrentTransform(), loadPool);
+        auto loaded = std::chrono::steady_clock::now();
+        auto mesh = scene.createObject<Mesh>(std::move(loader.vertices), std::move(loader.indices), material);
+        mesh->setTransform(Matrix4x4());
+        scene.addObject(mesh);
+        auto built = std::chrono::steady_clock::now();
+
+        double loadSeconds = std::chrono::duration<double>(loaded - start).count();
+        double megabytes = loader.bytesRead / (1024.0 * 1024.0);
+        std::cout << "Loaded mesh " << meshFilename << ": " << mesh->vertices.size() << " vertices, "
+                  << mesh->triangleCount() << " triangles, " << megabytes << " MB in " << loadSeconds << " s ("
+                  << megabytes / std::max(loadSeconds, 1e-9) << " MB/s), mesh BVH built in "
+                  << std::chrono::duration<double>(built - loaded).count() << " s" << std::endl;
+    }
 };
 
 
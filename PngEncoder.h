@@ -0,0 +1,339 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_PNGENCODER_H
+#define RAY_TRACER_PNGENCODER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// PNG writer for 8-bit RGB images that compresses chunks of rows independently, so large frames can be
+// encoded on every core. Each chunk is filtered, deflated (LZ77 with fixed Huffman codes, allowed to
+// reference the 32 KB before it like a single stream would) and ends with a sync flush, which puts it on
+// a byte boundary. The chunks are then concatenated as one zlib stream, each stored in its own IDAT chunk,
+// and their Adler-32 checksums are combined at the end.
+class PngEncoder {
+public:
+    // rgb holds height rows of width * 3 bytes, top row first. PNG has no empty images, so a zero width or
+    // height returns an empty vector.
+    static std::vector<uint8_t> encode(const uint8_t* rgb, int width, int height, ThreadPool* pool = nullptr) {
+        if (width <= 0 || height <= 0) return {};
+        size_t stride = static_cast<size_t>(width) * 3;
+        std::vector<uint8_t> filtered(height * (stride + 1));
+        int rowsPerChunk = static_cast<int>(std::max<size_t>(1, (size_t(1) << 17) / (stride + 1)));
+        int chunkCount = (height + rowsPerChunk - 1) / rowsPerChunk;
+
+        // Filtering only reads the unfiltered image, so chunks don't wait for each other there.
+        // Compressing a chunk looks back into the previous one's filtered rows, hence two passes.
+        auto filterChunk = [&](int chunk, int) {
+            int rowEnd = std::min(height, (chunk + 1) * rowsPerChunk);
+            for (int y = chunk * rowsPerChunk; y < rowEnd; y++) {
+                filterRow(rgb, stride, y, &filtered[y * (stride + 1)]);
+            }
+        };
+        std::vector<std::vector<uint8_t>> idats(chunkCount);
+        std::vector<uint32_t> adlers(chunkCount);
+        auto compressChunk = [&](int chunk, int) {
+            size_t begin = static_cast<size_t>(chunk) * rowsPerChunk * (stride + 1);
+            size_t end = std::min(filtered.size(), begin + static_cast<size_t>(rowsPerChunk) * (stride + 1));
+            std::vector<uint8_t>& idat = idats[chunk];
+            size_t start = beginChunk(idat, "IDAT");
+            deflate(filtered, begin, end, chunk == chunkCount - 1, idat);
+            endChunk(idat, start);
+            adlers[chunk] = adler32(&filtered[begin], end - begin);
+        };
+        if (pool != nullptr) {
+            pool->parallelFor(chunkCount, filterChunk);
+            pool->parallelFor(chunkCount, compressChunk);
+        } else {
+            for (int chunk = 0; chunk < chunkCount; chunk++) {
+                filterChunk(chunk, 0);
+            }
+            for (int chunk = 0; chunk < chunkCount; chunk++) {
+                compressChunk(chunk, 0);
+            }
+        }
+
+        std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        size_t start = beginChunk(png, "IHDR");
+        appendBigEndian(png, static_cast<uint32_t>(width));
+        appendBigEndian(png, static_cast<uint32_t>(height));
+        png.insert(png.end(), {8, 2, 0, 0, 0}); // 8 bits per channel, RGB, deflate, adaptive filtering, no interlace
+        endChunk(png, start);
+
+        start = beginChunk(png, "IDAT");
+        png.insert(png.end(), {0x78, 0x01}); // zlib header: deflate with a 32 KB window
+        endChunk(png, start);
+        uint32_t adler = 1;
+        for (int chunk = 0; chunk < chunkCount; chunk++) {
+            png.insert(png.end(), idats[chunk].begin(), idats[chunk].end());
+            size_t length = std::min(filtered.size() - static_cast<size_t>(chunk) * rowsPerChunk * (stride + 1),
+                                     static_cast<size_t>(rowsPerChunk) * (stride + 1));
+            adler = combineAdler32(adler, adlers[chunk], length);
+        }
+        start = beginChunk(png, "IDAT");
+        appendBigEndian(png, adler);
+        endChunk(png, start);
+
+        start = beginChunk(png, "IEND");
+        endChunk(png, start);
+        return png;
+    }
+
+private:
+    static const int windowSize = 32768;
+    static const int hashBits = 15;
+    static const int maxChainLength = 32; // Match candidates tried per position
+    static const int minMatch = 3, maxMatch = 258;
+
+    // Picks the PNG filter with the smallest sum of absolute residuals, the usual heuristic for photos
+    static void filterRow(const uint8_t* rgb, size_t stride, int y, uint8_t* out) {
+        const uint8_t* row = rgb + y * stride;
+        const uint8_t* above = y > 0 ? row - stride : nullptr;
+        int bestFilter = 0;
+        long bestScore = -1;
+        for (int filter = 0; filter < 5; filter++) {
+            long score = 0;
+            for (size_t i = 0; i < stride; i++) {
+                score += std::abs(static_cast<int8_t>(residual(filter, row, above, i)));
+            }
+            if (bestScore < 0 || score < bestScore) {
+                bestScore = score;
+                bestFilter = filter;
+            }
+        }
+        out[0] = static_cast<uint8_t>(bestFilter);
+        for (size_t i = 0; i < stride; i++) {
+            out[i + 1] = residual(bestFilter, row, above, i);
+        }
+    }
+
+    static uint8_t residual(int filter, const uint8_t* row, const uint8_t* above, size_t i) {
+        int a = i >= 3 ? row[i - 3] : 0;
+        int b = above != nullptr ? above[i] : 0;
+        int c = i >= 3 && above != nullptr ? above[i - 3] : 0;
+        switch (filter) {
+            case 1: return static_cast<uint8_t>(row[i] - a);
+            case 2: return static_cast<uint8_t>(row[i] - b);
+            case 3: return static_cast<uint8_t>(row[i] - (a + b) / 2);
+            case 4: {
+                int p = a + b - c;
+                int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                int predictor = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+                return static_cast<uint8_t>(row[i] - predictor);
+            }
+            default: return row[i];
+        }
+    }
+
+    // Deflate's output is a little-endian bit stream; Huffman codes go in most significant bit first
+    struct BitWriter {
+        std::vector<uint8_t>& out;
+        uint64_t buffer = 0;
+        int count = 0;
+
+        explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+        void write(uint32_t bits, int length) {
+            buffer |= static_cast<uint64_t>(bits) << count;
+            count += length;
+            while (count >= 8) {
+                out.push_back(static_cast<uint8_t>(buffer));
+                buffer >>= 8;
+                count -= 8;
+            }
+        }
+
+        void writeCode(uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; i++) {
+                reversed |= ((code >> i) & 1) << (length - 1 - i);
+            }
+            write(reversed, length);
+        }
+
+        void alignToByte() {
+            if (count > 0) {
+                write(0, 8 - count);
+            }
+        }
+    };
+
+    static void writeLiteral(BitWriter& bits, int symbol) {
+        if (symbol < 144) bits.writeCode(0x30 + symbol, 8);
+        else if (symbol < 256) bits.writeCode(0x190 + symbol - 144, 9);
+        else if (symbol < 280) bits.writeCode(symbol - 256, 7);
+        else bits.writeCode(0xC0 + symbol - 280, 8);
+    }
+
+    static void writeMatch(BitWriter& bits, int length, int distance) {
+        static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                           67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                            4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                             513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+                                              9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        int lengthCode = 28;
+        while (lengthBase[lengthCode] > length) lengthCode--;
+        writeLiteral(bits, 257 + lengthCode);
+        bits.write(length - lengthBase[lengthCode], lengthExtra[lengthCode]);
+
+        int distanceCode = 29;
+        while (distanceBase[distanceCode] > distance) distanceCode--;
+        bits.writeCode(distanceCode, 5);
+        bits.write(distance - distanceBase[distanceCode], distanceExtra[distanceCode]);
+    }
+
+    static uint32_t hash3(const uint8_t* p) {
+        uint32_t value = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+        return (value * 2654435761u) >> (32 - hashBits);
+    }
+
+    // Compresses data[begin, end) as one fixed Huffman block. Matches may reach back before begin, since
+    // the decoder has that data already. Non-final blocks are followed by an empty stored block (sync flush).
+    static void deflate(const std::vector<uint8_t>& data, size_t begin, size_t end, bool last, std::vector<uint8_t>& out) {
+        size_t windowStart = begin > static_cast<size_t>(windowSize) ? begin - windowSize : 0;
+        std::vector<int32_t> head(size_t(1) << hashBits, -1);
+        std::vector<int32_t> previous(end - windowStart, -1); // Chain links, indexed by position - windowStart
+        auto insert = [&](size_t position) {
+            if (position + minMatch > end) return;
+            uint32_t hash = hash3(&data[position]);
+            previous[position - windowStart] = head[hash];
+            head[hash] = static_cast<int32_t>(position);
+        };
+        for (size_t position = windowStart; position < begin; position++) {
+            insert(position);
+        }
+
+        BitWriter bits(out);
+        bits.write(last ? 1 : 0, 1); // BFINAL
+        bits.write(1, 2);            // BTYPE = fixed Huffman codes
+
+        size_t position = begin;
+        while (position < end) {
+            int bestLength = 0, bestDistance = 0;
+            if (position + minMatch <= end) {
+                int limit = static_cast<int>(std::min<size_t>(maxMatch, end - position));
+                int32_t candidate = head[hash3(&data[position])];
+                for (int chain = 0; chain < maxChainLength && candidate >= 0; chain++) {
+                    int distance = static_cast<int>(position - candidate);
+                    if (distance > windowSize) break;
+                    int length = 0;
+                    while (length < limit && data[candidate + length] == data[position + length]) length++;
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = distance;
+                        if (length == limit) break;
+                    }
+                    candidate = previous[candidate - windowStart];
+                }
+            }
+
+            if (bestLength >= minMatch) {
+                writeMatch(bits, bestLength, bestDistance);
+                for (int i = 0; i < bestLength; i++) {
+                    insert(position + i);
+                }
+                position += bestLength;
+            } else {
+                writeLiteral(bits, data[position]);
+                insert(position);
+                position++;
+            }
+        }
+        writeLiteral(bits, 256); // End of block
+
+        if (!last) {
+            bits.write(0, 3); // Empty stored block: BFINAL = 0, BTYPE = 0, then LEN = 0 and NLEN = ~0
+            bits.alignToByte();
+            out.insert(out.end(), {0x00, 0x00, 0xFF, 0xFF});
+        } else {
+            bits.alignToByte();
+        }
+    }
+
+    static uint32_t adler32(const uint8_t* data, size_t length) {
+        const uint32_t base = 65521;
+        uint32_t a = 1, b = 0;
+        while (length > 0) {
+            size_t block = std::min<size_t>(length, 5552); // Longest run before b can overflow
+            for (size_t i = 0; i < block; i++) {
+                a += data[i];
+                b += a;
+            }
+            a %= base;
+            b %= base;
+            data += block;
+            length -= block;
+        }
+        return (b << 16) | a;
+    }
+
+    // Checksum of two concatenated pieces from their checksums, as in zlib's adler32_combine
+    static uint32_t combineAdler32(uint32_t first, uint32_t second, size_t secondLength) {
+        const uint32_t base = 65521;
+        uint32_t remainder = static_cast<uint32_t>(secondLength % base);
+        uint32_t sum1 = first & 0xFFFF;
+        uint32_t sum2 = static_cast<uint32_t>((static_cast<uint64_t>(remainder) * sum1) % base);
+        sum1 += (second & 0xFFFF) + base - 1;
+        sum2 += (first >> 16) + (second >> 16) + base - remainder;
+        if (sum1 >= base) sum1 -= base;
+        if (sum1 >= base) sum1 -= base;
+        if (sum2 >= 2 * base) sum2 -= 2 * base;
+        if (sum2 >= base) sum2 -= base;
+        return (sum2 << 16) | sum1;
+    }
+
+    static uint32_t crc32(const uint8_t* data, size_t length) {
+        struct Table {
+            uint32_t values[256];
+            Table() {
+                for (uint32_t n = 0; n < 256; n++) {
+                    uint32_t c = n;
+                    for (int k = 0; k < 8; k++) {
+                        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    }
+                    values[n] = c;
+                }
+            }
+        };
+        static const Table table; // Built once, thread-safe since C++11
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < length; i++) {
+            crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    static void appendBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+        out.insert(out.end(), {static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16),
+                               static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value)});
+    }
+
+    // A chunk is its data length, type, data and the CRC of type and data. beginChunk returns where the
+    // chunk starts; endChunk fills in the length once the data is known.
+    static size_t beginChunk(std::vector<uint8_t>& out, const char* type) {
+        size_t start = out.size();
+        appendBigEndian(out, 0);
+        out.insert(out.end(), type, type + 4);
+        return start;
+    }
+
+    static void endChunk(std::vector<uint8_t>& out, size_t start) {
+        uint32_t length = static_cast<uint32_t>(out.size() - start - 8);
+        for (int i = 0; i < 4; i++) {
+            out[start + i] = static_cast<uint8_t>(length >> (24 - 8 * i));
+        }
+        appendBigEndian(out, crc32(&out[start + 4], length + 4));
+    }
+};
+
+
+#endif //RAY_TRACER_PNGENCODER_H
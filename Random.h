@@ -0,0 +1,51 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_RANDOM_H
+#define RAY_TRACER_RANDOM_H
+
+#include <cstdint>
+
+// Small, fast PCG32 generator. Streams are seeded explicitly (e.g. from pixel coordinates) so results
+// never depend on which thread happens to render a pixel.
+class Random {
+public:
+    Random(uint64_t seed = 0) {
+        setSeed(seed);
+    }
+
+    void setSeed(uint64_t seed) {
+        state = 0;
+        next();
+        state += mix(seed);
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t xorShifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+
+    // Uniform float in [0, 1)
+    float nextFloat() {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // SplitMix64 finalizer, spreads nearby seeds (neighbouring pixels) across the state space
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+private:
+    uint64_t state;
+};
+
+
+#endif //RAY_TRACER_RANDOM_H
@@ -6,25 +6,54 @@
 #define RAY_TRACER_RAYTRACER_H
 
 #include <algorithm>
-#include <thread>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 
 #include "Film.h"
 #include "Scene.h"
 #include "Sampler.h"
+#include "Tile.h"
+#include "ThreadPool.h"
+#include "ShadowCache.h"
+#include "ShadingCache.h"
+#include "LightTree.h"
+#include "RenderStats.h"
+#include "Timeline.h"
 #include "Vector3.h"
 #include "Ray.h"
 
 class RayTracer {
 public:
-    RayTracer(int maxRecursionDepth = 5) : maxRecursionDepth(maxRecursionDepth), pixelsProcessed(0) {}
+    RayTracer(int maxRecursionDepth = 5) : maxRecursionDepth(maxRecursionDepth), pixelsProcessed(0),
+                                                     shadowCacheLookups(0), shadowCacheHits(0), areaLightQueries(0),
+                                                     areaShadowRays(0), replayHits(false) {}
 
-    void trace(const Scene& scene, Film& film) {
-        Sampler sampler;
-        int totalPixels = scene.width * scene.height;
-        int progressWidth = 50; // Width of the progress bar in characters
-        const int progressBarUpdateFrequency = 100; // Update every 100 pixels
+    // Called from the render thread that finished a tile, as soon as its pixels are in the film
+    typedef std::function<void(const Tile&)> TileCallback;
+
+    int tileSize = 32;   // Edge length of the square tiles threads pick up, in pixels
+    bool verbose = true; // Progress bar and per-trace summary on stdout
+    bool deterministic = false; // Restart per-thread caches at every tile, so the image doesn't depend on scheduling
+    ShadingCache* shadingCache = nullptr; // Records primary hits, and re-shades from them while the view is unchanged
+
+    // Renders the scene's crop window (the whole image by default). The film may be full size or cover
+    // just the window; time is proportional to the window's area either way.
+    void trace(const Scene& scene, Film& film, const TileCallback& onTileDone = TileCallback()) {
+        trace(scene, film, Tile::split(scene.pixelWindow(), tileSize), onTileDone);
+    }
+
+    // Renders only the given tiles of the image, e.g. the part of a frame assigned to this process
+    void trace(const Scene& scene, Film& film, const std::vector<Tile>& tiles,
+               const TileCallback& onTileDone = TileCallback()) {
+        TimelineScope timelineScope("trace");
+        int totalPixels = 0;
+        for (const Tile& tile : tiles) {
+            totalPixels += tile.pixelCount();
+        }
 
         auto startTime = std::chrono::high_resolution_clock::now();  // Record start time
 
@@ -32,104 +61,354 @@ public:
             maxRecursionDepth = scene.maxRecursionDepth;
         }
 
-        // Parallelization stuff
-        int numThreads = std::thread::hardware_concurrency(); // Get the number of available cores
-        std::vector<std::thread> threads(numThreads);
-
-        int rowsPerThread = scene.height / numThreads;
-
-        for (int i = 0; i < numThreads; i++) {
-            int startY = i * rowsPerThread;
-            int endY = (i == numThreads - 1) ? scene.height : startY + rowsPerThread;
-
-            threads[i] = std::thread([&, startY, endY]() {
-                for (int y = startY; y < endY; y++) {
-                    for (int x = 0; x < scene.width; x++) {
-                        Vector3 sample = sampler.getSample(x, y);
-                        Ray ray = scene.createRay(sample);
-                        Intersection hit = scene.intersect(ray);
-                        Vector3 color = findColor(ray, hit, scene);
-                        film.addSample(x, y, color);
-
-                        // Update progress bar
-                        pixelsProcessed.fetch_add(1);
-                        if (pixelsProcessed % progressBarUpdateFrequency == 0) {
-                            std::lock_guard<std::mutex> lock(progressMutex);
-                            int progress = (pixelsProcessed * progressWidth) / totalPixels;
-
-                            auto currentTime = std::chrono::high_resolution_clock::now();
-                            auto elapsedTime = std::chrono::duration_cast<std::chrono::seconds>(
-                                    currentTime - startTime).count();
-                            float timePerPixel = elapsedTime / static_cast<float>(pixelsProcessed);
-                            float estimatedRemainingTime = timePerPixel * (totalPixels - pixelsProcessed);
-
-                            std::cout << "\r[";
-                            for (int i = 0; i < progressWidth; i++) {
-                                if (i < progress) {
-                                    std::cout << "=";
-                                } else {
-                                    std::cout << " ";
-                                }
-                            }
-                            std::cout << "] " << (100 * pixelsProcessed) / totalPixels
-                                      << "%, Estimated time remaining: " << estimatedRemainingTime << "s";
-                            std::cout.flush();
-                        }
-                    }
-                }
-            });
+        stats = RenderStats();
+        pixelsProcessed = 0;
+        shadowCacheLookups = 0;
+        shadowCacheHits = 0;
+        areaLightQueries = 0;
+        areaShadowRays = 0;
+
+        if (scene.lightCutoff > 0) {
+            TimelineScope buildScope("build light tree");
+            lightTree.build(scene);
+            std::cout << "Many-light mode: " << scene.lights.size() << " lights, " << lightTree.nodeCount()
+                      << " light tree nodes, cutoff " << scene.lightCutoff << std::endl;
         }
 
-        for (auto& thread : threads) {
-            thread.join(); // Wait for all threads to finish
+        replayHits = shadingCache != nullptr && shadingCache->prepare(scene);
+        if (replayHits && verbose) {
+            std::cout << "Re-shading " << shadingCache->hitCount() << " cached primary hits" << std::endl;
         }
+
+        // Parallelization stuff: pool workers pull tiles from a shared counter, which balances uneven scenes
+        ThreadPool& pool = threadPool();
+
+        std::vector<ThreadState> states; // One per worker, so no locking on the hot path
+        states.reserve(pool.size());
+        for (int i = 0; i < pool.size(); i++) {
+            states.push_back(ThreadState(scene));
+        }
+        pool.run([](int) { RenderStats::forThread() = RenderStats(); });
+
+        pool.parallelFor(static_cast<int>(tiles.size()), [&](int t, int worker) {
+            if (deterministic) {
+                // The shadow cache answers from the last occluder this worker saw. That doesn't change which
+                // points are shadowed, except where a ray grazes the occluder's bounding box and rounding
+                // decides. Starting every tile cold makes the result depend only on the tile.
+                states[worker].shadowCache.reset();
+            }
+            {
+                TimelineScope tileScope("render tile", t);
+                renderTile(tiles[t], scene, film, states[worker]);
+            }
+            if (onTileDone) {
+                onTileDone(tiles[t]);
+            }
+            if (verbose) {
+                updateProgress(tiles[t].pixelCount(), totalPixels, startTime);
+            }
+        });
+
+        pool.run([&](int worker) {
+            shadowCacheLookups.fetch_add(states[worker].shadowCache.lookups);
+            shadowCacheHits.fetch_add(states[worker].shadowCache.hits);
+            areaLightQueries.fetch_add(states[worker].areaLightQueries);
+            areaShadowRays.fetch_add(states[worker].areaShadowRays);
+
+            std::lock_guard<std::mutex> lock(progressMutex);
+            stats += RenderStats::forThread();
+        });
+        if (!verbose) return;
         std::cout << "\n";
+
+        long long lookups = shadowCacheLookups.load(), hits = shadowCacheHits.load();
+        std::cout << "Shadow cache: " << hits << " hits / " << lookups << " lookups ("
+                  << (lookups > 0 ? 100.0 * hits / lookups : 0.0) << "%)" << std::endl;
+        if (areaLightQueries.load() > 0) {
+            std::cout << "Area lights: " << static_cast<double>(areaShadowRays.load()) / areaLightQueries.load()
+                      << " shadow rays per shading point" << std::endl;
+        }
+
+#ifdef RAY_TRACER_STATS
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+        stats.print(std::cout, seconds);
+#endif
+    }
+
+    // Replaces the worker pool. threadCount <= 0 uses every hardware thread; pinThreads binds workers to cores.
+    void setThreadCount(int threadCount, bool pinThreads = false) {
+        pool.reset(new ThreadPool(threadCount, pinThreads));
+    }
+
+    // The renderer's persistent workers, created on first use. Shared with anything that wants to run
+    // in parallel between traces (acceleration structure builds, image encoding).
+    ThreadPool& threadPool() {
+        if (!pool) {
+            pool.reset(new ThreadPool());
+        }
+        return *pool;
+    }
+
+    // Counters summed over all threads of the last trace (only populated in RAY_TRACER_STATS builds)
+    const RenderStats& getStats() const {
+        return stats;
     }
 
 
 private:
+    // Scratch data owned by a single render thread
+    struct ThreadState {
+        ShadowCache shadowCache;
+        Sampler sampler;                 // Restarted per pixel sample so results don't depend on scheduling
+        std::vector<size_t> allLights;   // Every light index, used when many-light mode is off
+        std::vector<size_t> lightBuffer; // Reused per shading point to avoid allocations
+        long long areaLightQueries = 0;
+        long long areaShadowRays = 0;
+
+        explicit ThreadState(const Scene& scene) : shadowCache(scene.lights.size()), sampler(scene.samplesPerPixel) {
+            for (size_t i = 0; i < scene.lights.size(); i++) {
+                allLights.push_back(i);
+            }
+        }
+    };
+
     int maxRecursionDepth;
+    std::unique_ptr<ThreadPool> pool;
+    LightTree lightTree;
+    RenderStats stats;
     std::atomic<int> pixelsProcessed;
     std::mutex progressMutex;
+    std::atomic<long long> shadowCacheLookups; // Totals over all threads' shadow caches
+    std::atomic<long long> shadowCacheHits;
+    std::atomic<long long> areaLightQueries; // Area light shading points and the shadow rays they took
+    std::atomic<long long> areaShadowRays;
+    bool replayHits; // The current trace rebuilds recorded primary hits from shadingCache
+
+    void renderTile(const Tile& tile, const Scene& scene, Film& film, ThreadState& state) {
+        Sampler& sampler = state.sampler;
+        int samples = sampler.samplesPerPixel();
+        bool features = film.hasFeatureBuffers();
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+#ifdef RAY_TRACER_STATS
+                long long costBefore = RenderStats::forThread().cost();
+#endif
+                Vector3 color(0, 0, 0), squares(0, 0, 0);
+                Film::Features pixelFeatures = {Vector3(0, 0, 0), Vector3(0, 0, 0), 0.0f, 0.0f, 0, 0};
+                for (int s = 0; s < samples; s++) {
+                    sampler.startPixelSample(x, y, s);
+                    Ray ray = scene.createRay(sampler.getPixelSample());
+                    RT_STAT(primaryRays, 1);
+                    Intersection hit;
+                    uint8_t* visibility = nullptr; // Cached light visibility of the primary hit
+                    if (shadingCache != nullptr) {
+                        size_t index = shadingCache->sampleIndex(x, y, s);
+                        if (replayHits && shadingCache->isRecorded(index)) {
+                            hit = shadingCache->replay(scene, index);
+                        } else {
+                            hit = scene.intersect(ray);
+                            shadingCache->record(index, hit);
+                        }
+                        visibility = shadingCache->lightVisibility(index);
+                    } else {
+                        hit = scene.intersect(ray);
+                    }
+                    if (hit && features) {
+                        pixelFeatures.albedo += hit.material.kd;
+                        pixelFeatures.normal += hit.normal.normalize();
+                        pixelFeatures.depth += (hit.point - ray.origin).length();
+                        if (s == 0) {
+                            pixelFeatures.objectId = static_cast<uint32_t>(hit.objectIndex + 1);
+                            pixelFeatures.primitiveId = static_cast<uint32_t>(hit.object->sourcePrimitive(hit.primitive));
+                        }
+                    }
+                    Vector3 sampleColor = findColor(ray, hit, scene, state, visibility);
+                    color += sampleColor;
+                    squares += sampleColor * sampleColor;
+                }
+                film.addSample(x, y, color / static_cast<float>(samples));
+                if (features) {
+                    pixelFeatures.albedo /= static_cast<float>(samples);
+                    pixelFeatures.normal /= static_cast<float>(samples);
+                    pixelFeatures.depth /= samples;
+                    pixelFeatures.variance = meanVariance(color, squares, samples);
+                    film.addFeatures(x, y, pixelFeatures);
+                }
+#ifdef RAY_TRACER_STATS
+                if (film.hasCostBuffer()) {
+                    film.addCost(x, y, static_cast<float>(RenderStats::forThread().cost() - costBefore));
+                }
+#endif
+            }
+        }
+    }
+
+    // Variance of the mean of n samples, from their sum and sum of squares, averaged over the channels
+    static float meanVariance(const Vector3& sum, const Vector3& squares, int n) {
+        if (n < 2) return 0.0f;
+        Vector3 mean = sum / static_cast<float>(n);
+        Vector3 spread = squares / static_cast<float>(n) - mean * mean;
+        return std::max(0.0f, (spread.x + spread.y + spread.z) / 3.0f) / (n - 1);
+    }
+
+    void updateProgress(int pixelsDone, int totalPixels, std::chrono::high_resolution_clock::time_point startTime) {
+        const int progressWidth = 50; // Width of the progress bar in characters
+
+        int processed = pixelsProcessed.fetch_add(pixelsDone) + pixelsDone;
+        std::lock_guard<std::mutex> lock(progressMutex);
+        int progress = static_cast<int>((static_cast<long long>(processed) * progressWidth) / totalPixels);
+
+        auto currentTime = std::chrono::high_resolution_clock::now();
+        auto elapsedTime = std::chrono::duration_cast<std::chrono::seconds>(currentTime - startTime).count();
+        float timePerPixel = elapsedTime / static_cast<float>(processed);
+        float estimatedRemainingTime = timePerPixel * (totalPixels - processed);
+
+        std::cout << "\r[";
+        for (int i = 0; i < progressWidth; i++) {
+            if (i < progress) {
+                std::cout << "=";
+            } else {
+                std::cout << " ";
+            }
+        }
+        std::cout << "] " << (100LL * processed) / totalPixels
+                  << "%, Estimated time remaining: " << estimatedRemainingTime << "s";
+        std::cout.flush();
+    }
+
+    // Iterative integrator: follows the chain of mirror reflections while tracking the path throughput
+    // (product of ks along the chain) instead of recursing. Paths stop at maxRecursionDepth, once the
+    // throughput falls below the scene's epsilon, or when Russian roulette terminates them. primaryVisibility
+    // caches the point and directional light visibility of the first hit (see ShadingCache).
+    Vector3 findColor(Ray ray, Intersection intersection, const Scene& scene, ThreadState& state,
+                      uint8_t* primaryVisibility = nullptr) {
+        Vector3 color(0, 0, 0);
+        Vector3 throughput(1, 1, 1);
+
+        for (int depth = 0; intersection; depth++) {
+            color += throughput * shade(ray, intersection, scene, state, depth == 0 ? primaryVisibility : nullptr);
+
+            const Vector3& ks = intersection.material.ks;
+            if (depth >= maxRecursionDepth || ks.isBlack()) break;
+
+            throughput = throughput * ks;
+            float maxThroughput = std::max(throughput.x, std::max(throughput.y, throughput.z));
+            if (maxThroughput < scene.throughputEpsilon) break;
+
+            if (scene.russianRouletteDepth >= 0 && depth >= scene.russianRouletteDepth) {
+                float survival = std::min(1.0f, maxThroughput);
+                if (state.sampler.get1D() >= survival) break;
+                throughput /= survival; // Keeps the estimate unbiased
+            }
+
+            // Reflection
+            RT_STAT(reflectionRays, 1);
+            Vector3 reflectionDirection = ray.direction - 2 * ray.direction.dot(intersection.normal) * intersection.normal;
+            Vector3 offset = reflectionDirection * 1e-3f; // Small offset in reflection direction
+            ray = Ray(intersection.point + offset, reflectionDirection);
+            intersection = scene.intersect(ray);
+        }
 
-    Vector3 findColor(const Ray& ray, const Intersection& intersection, const Scene& scene, int depth = 0) {
-        if (!intersection) return Vector3(0, 0, 0); // Return black if no intersection
+        color.clamp(); // Clamp once at the end so no energy is lost along the path
+        return color;
+    }
 
+    // Local shading at a hit point: ambient, emission and the unshadowed lights. Shadow tests towards point and
+    // directional lights are read from and written to visibility when given.
+    Vector3 shade(const Ray& ray, const Intersection& intersection, const Scene& scene, ThreadState& state,
+                  uint8_t* visibility = nullptr) {
         Vector3 color = intersection.material.ambient + intersection.material.emission; // Global ambient and emission
 
-        for (const auto& light : scene.lights) {
+        const std::vector<size_t>& lightIndices = selectLights(intersection.point, scene, state);
+        for (size_t lightIndex : lightIndices) {
+            const auto& light = scene.lights[lightIndex];
+            if (light->isArea()) {
+                color += shadeAreaLight(ray, intersection, scene, state, lightIndex);
+                continue;
+            }
             Vector3 toLight;
             if (light->type == Light::Type::Directional) {
                 toLight = -light->direction; // Directional light's direction is constant
             } else {
                 toLight = (light->position - intersection.point).normalize(); // Point light's direction depends on position
             }
-            Vector3 offset = toLight * 1e-3f; // Small offset towards the light
-            Ray shadowRay(intersection.point + offset, toLight); // Start the shadow ray slightly towards the light
+            bool shadowed;
+            if (visibility != nullptr && visibility[lightIndex] != ShadingCache::Unknown) {
+                shadowed = visibility[lightIndex] == ShadingCache::Shadowed;
+            } else {
+                Vector3 offset = toLight * 1e-3f; // Small offset towards the light
+                Ray shadowRay(intersection.point + offset, toLight); // Start the shadow ray slightly towards the light
 
-            // Check for shadow
-            if (!scene.isShadowed(shadowRay, light)) {
+                // Check for shadow
+                RT_STAT(shadowRays, 1);
+                shadowed = state.shadowCache.isShadowed(scene, shadowRay, lightIndex);
+                if (visibility != nullptr) {
+                    visibility[lightIndex] = shadowed ? ShadingCache::Shadowed : ShadingCache::Visible;
+                }
+            }
+            if (!shadowed) {
                 float attenuation = (light->type == Light::Type::Point) ? scene.attenuation(intersection.point, light) : 1.0f; // Apply attenuation only for point lights
-                Vector3 diffuse = intersection.material.kd * std::max(0.0f, intersection.normal.dot(toLight));
-                Vector3 viewDirection = -ray.direction; // View direction is opposite to ray direction
-                Vector3 halfVector = (toLight + viewDirection).normalize(); // Half-vector
-                Vector3 specular = intersection.material.ks * pow(std::max(0.0f, intersection.normal.dot(halfVector)), intersection.material.shininess);
-                Vector3 lightContribution = (diffuse + specular) * light->color; // Multiply by the light's color intensity
-                color += attenuation * lightContribution; // Apply attenuation
+                color += attenuation * phong(ray, intersection, toLight, light->color); // Apply attenuation
             }
         }
+        return color;
+    }
 
-        // Reflection
-        if (depth < maxRecursionDepth && !intersection.material.ks.isBlack()) {
-            Vector3 reflectionDirection = ray.direction - 2 * ray.direction.dot(intersection.normal) * intersection.normal;
-            Vector3 offset = reflectionDirection * 1e-3f; // Small offset in reflection direction
-            Ray reflectionRay(intersection.point + offset, reflectionDirection);
-            Vector3 reflectionColor = findColor(reflectionRay, scene.intersect(reflectionRay), scene, depth + 1);
-            color += intersection.material.ks * reflectionColor; // Add reflection contribution
+    // Soft shadows: stratified shadow rays towards points on the light, each point lighting like a point light
+    // and the results averaged. In adaptive mode the first few rays decide: when they all agree that the
+    // point is lit, or that it is in the umbra, the remaining points are shaded (or skipped) without rays.
+    Vector3 shadeAreaLight(const Ray& ray, const Intersection& intersection, const Scene& scene, ThreadState& state,
+                           size_t lightIndex) {
+        const Light& light = *scene.lights[lightIndex];
+        int count = light.samples;
+        int initial = scene.adaptiveShadowSamples > 0 ? std::min(scene.adaptiveShadowSamples, count) : count;
+        Sampler::PointSet points = state.sampler.startPointSet(count);
+
+        Vector3 color(0, 0, 0);
+        int visible = 0;
+        bool traceRays = true;
+        for (int i = 0; i < count; i++) {
+            if (i == initial && (visible == 0 || visible == i)) {
+                if (visible == 0) break; // Umbra
+                traceRays = false;       // Fully lit
+            }
+
+            float u, v;
+            points.point(i, u, v);
+            Vector3 target = light.samplePoint(intersection.point, u, v);
+            Vector3 toLight = (target - intersection.point).normalize();
+            if (traceRays) {
+                Ray shadowRay(intersection.point + toLight * 1e-3f, toLight);
+                RT_STAT(shadowRays, 1);
+                state.areaShadowRays++;
+                if (state.shadowCache.isShadowed(scene, shadowRay, lightIndex, (target - shadowRay.origin).length())) {
+                    continue;
+                }
+                visible++;
+            }
+            float attenuation = scene.attenuation((target - intersection.point).length());
+            color += attenuation * phong(ray, intersection, toLight, light.color);
         }
+        state.areaLightQueries++;
+        return color / static_cast<float>(count);
+    }
 
-        color.clamp();
-        return color;
+    // Diffuse and specular response to unshadowed light of the given color arriving from toLight
+    static Vector3 phong(const Ray& ray, const Intersection& intersection, const Vector3& toLight, const Vector3& lightColor) {
+        Vector3 diffuse = intersection.material.kd * std::max(0.0f, intersection.normal.dot(toLight));
+        Vector3 viewDirection = -ray.direction; // View direction is opposite to ray direction
+        Vector3 halfVector = (toLight + viewDirection).normalize(); // Half-vector
+        Vector3 specular = intersection.material.ks * pow(std::max(0.0f, intersection.normal.dot(halfVector)), intersection.material.shininess);
+        return (diffuse + specular) * lightColor; // Multiply by the light's color intensity
+    }
+
+    // Lights worth shading at a point: all of them, or only those surviving the light tree's cutoff
+    const std::vector<size_t>& selectLights(const Vector3& point, const Scene& scene, ThreadState& state) const {
+        if (scene.lightCutoff <= 0) return state.allLights;
+
+        state.lightBuffer.clear();
+        lightTree.collect(scene, point, scene.lightCutoff, state.lightBuffer);
+        return state.lightBuffer;
     }
 
 };
@@ -0,0 +1,250 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_RENDERCOORDINATOR_H
+#define RAY_TRACER_RENDERCOORDINATOR_H
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Film.h"
+#include "RenderWorker.h"
+#include "Socket.h"
+#include "Tile.h"
+
+// Farms the tiles of one frame out to RenderWorker processes, over TCP ("host:port") or a Unix domain socket,
+// and assembles the results in a Film. Workers may join at any time; when one disconnects (crashed, killed,
+// network gone) the tiles it was working on go back to the queue and are handed to the others.
+//
+// Protocol, one line per message (worker -> coordinator / coordinator -> worker):
+//     HELLO <threads>                   worker connected
+//     SCENE <w> <h> <file>              scene to parse and render at w x h pixels; workers must see the same
+//                                       path (shared filesystem)
+//     READY                             scene loaded
+//     TILE <index> <x0> <y0> <x1> <y1>  render this block of pixels
+//     RESULT <index>                    followed by (x1-x0)*(y1-y0) RGB float32 triples in row-major order
+//     ERROR <message>                   the worker gives up
+//     DONE                              frame finished, worker exits
+class RenderCoordinator {
+public:
+    int tileSize = 64;       // Edge length of a tile assignment, in pixels
+    int tilesPerWorker = 2;  // Assignments in flight per worker, so workers don't idle during the round trip
+
+    explicit RenderCoordinator(const std::string& address) : address(address), listener(Socket::listenOn(address)) {
+        std::cout << "Coordinator listening on " << address << std::endl;
+    }
+
+    ~RenderCoordinator() {
+        for (pid_t child : children) {
+            ::waitpid(child, nullptr, 0);
+        }
+        if (!Socket::isTcpAddress(address)) {
+            ::unlink(Socket::unixPath(address).c_str());
+        }
+    }
+
+    RenderCoordinator(const RenderCoordinator&) = delete;
+    RenderCoordinator& operator=(const RenderCoordinator&) = delete;
+
+    // Forks worker processes on this machine that connect back to us. Must be called before this process
+    // starts any threads, since only the forking thread survives in the child.
+    void spawnLocalWorkers(int count, int threadsPerWorker = 0) {
+        for (int i = 0; i < count; i++) {
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                throw std::runtime_error("fork failed: " + std::string(std::strerror(errno)));
+            }
+            if (pid == 0) {
+                ::close(listener.descriptor());
+                int status = 0;
+                try {
+                    RenderWorker(address, threadsPerWorker).run();
+                } catch (const std::exception& e) {
+                    std::cerr << "Worker failed: " << e.what() << std::endl;
+                    status = 1;
+                }
+                std::cout.flush();
+                ::_exit(status); // Skip the parent's destructors, they'd close its sockets and reap its children
+            }
+            children.push_back(pid);
+        }
+    }
+
+    // Renders the crop window of scene, parsed from sceneFile, into film (full size or just the window).
+    // Returns once every tile is in.
+    void render(const std::string& sceneFile, const Scene& scene, Film& film) {
+        if (scene.hasEmptyWindow()) {
+            throw std::runtime_error("The crop window contains no pixels");
+        }
+        sceneMessage = "SCENE " + std::to_string(scene.width) + " " + std::to_string(scene.height) + " " + sceneFile;
+        tiles = Tile::split(scene.pixelWindow(), tileSize);
+        pending.clear();
+        for (size_t i = 0; i < tiles.size(); i++) {
+            pending.push_back(static_cast<int>(i));
+        }
+        received.assign(tiles.size(), false);
+        completed = 0;
+
+        while (completed < static_cast<int>(tiles.size())) {
+            std::vector<pollfd> fds(1 + workers.size());
+            fds[0].fd = listener.descriptor();
+            fds[0].events = POLLIN;
+            for (size_t i = 0; i < workers.size(); i++) {
+                fds[i + 1].fd = workers[i]->socket.descriptor();
+                fds[i + 1].events = POLLIN;
+            }
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("poll failed: " + std::string(std::strerror(errno)));
+            }
+
+            // Backwards, so dropping a worker doesn't shift the ones still to be checked
+            for (size_t i = workers.size(); i-- > 0;) {
+                if (fds[i + 1].revents == 0) continue;
+                bool alive = handleMessage(*workers[i], film);
+                while (alive && workers[i]->socket.hasBufferedLine()) {
+                    alive = handleMessage(*workers[i], film);
+                }
+                if (!alive) {
+                    dropWorker(i);
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                acceptWorker();
+            }
+            assignTiles();
+        }
+        std::cout << std::endl;
+
+        for (auto& worker : workers) {
+            worker->socket.sendLine("DONE");
+        }
+        workers.clear();
+    }
+
+private:
+    struct Connection {
+        Socket socket;
+        int id;
+        bool ready;            // Scene loaded, can take tiles
+        std::vector<int> busy; // Tiles assigned but not returned yet
+    };
+
+    std::string address;
+    Socket listener;
+    std::vector<pid_t> children;
+    std::vector<std::unique_ptr<Connection>> workers;
+    int nextWorkerId = 0;
+
+    std::string sceneMessage;
+    std::vector<Tile> tiles;
+    std::deque<int> pending;    // Tiles waiting for a worker, reissued ones first
+    std::vector<bool> received;
+    int completed = 0;
+
+    void acceptWorker() {
+        std::unique_ptr<Connection> worker(new Connection());
+        worker->socket = listener.accept();
+        worker->id = nextWorkerId++;
+        worker->ready = false;
+        workers.push_back(std::move(worker));
+    }
+
+    // Returns false if the worker is gone or misbehaved
+    bool handleMessage(Connection& worker, Film& film) {
+        std::string line;
+        if (!worker.socket.readLine(line)) return false;
+        std::istringstream iss(line);
+        std::string command;
+        iss >> command;
+
+        if (command == "HELLO") {
+            int threads = 0;
+            iss >> threads;
+            std::cout << "Worker " << worker.id << " connected (" << threads << " threads)" << std::endl;
+            return worker.socket.sendLine(sceneMessage);
+        }
+        if (command == "READY") {
+            worker.ready = true;
+            return true;
+        }
+        if (command == "RESULT") {
+            int index = -1;
+            iss >> index;
+            auto it = std::find(worker.busy.begin(), worker.busy.end(), index);
+            if (it == worker.busy.end()) {
+                std::cerr << "Worker " << worker.id << " returned a tile it wasn't assigned: " << line << std::endl;
+                return false;
+            }
+            const Tile& tile = tiles[index];
+            std::vector<float> data(tile.pixelCount() * 3);
+            if (!worker.socket.recvAll(data.data(), data.size() * sizeof(float))) return false;
+            worker.busy.erase(it);
+
+            const float* value = data.data();
+            for (int y = tile.y0; y < tile.y1; y++) {
+                for (int x = tile.x0; x < tile.x1; x++, value += 3) {
+                    film.pixel(x, y) = Vector3(value[0], value[1], value[2]);
+                }
+            }
+            if (!received[index]) {
+                received[index] = true;
+                completed++;
+                std::cout << "\rTiles: " << completed << "/" << tiles.size() << std::flush;
+            }
+            return true;
+        }
+        if (command == "ERROR") {
+            std::cerr << "Worker " << worker.id << ": " << line.substr(6) << std::endl;
+        }
+        return false;
+    }
+
+    void dropWorker(size_t i) {
+        Connection& worker = *workers[i];
+        for (auto it = worker.busy.rbegin(); it != worker.busy.rend(); ++it) {
+            pending.push_front(*it);
+        }
+        std::cout << "\nWorker " << worker.id << " disconnected, reissuing " << worker.busy.size() << " tiles"
+                  << std::endl;
+        workers.erase(workers.begin() + i);
+        if (workers.empty() && completed < static_cast<int>(tiles.size())) {
+            std::cout << "No workers left, waiting for new ones on " << address << std::endl;
+        }
+    }
+
+    void assignTiles() {
+        for (size_t i = workers.size(); i-- > 0;) {
+            Connection& worker = *workers[i];
+            bool alive = true;
+            while (alive && worker.ready && !pending.empty() && static_cast<int>(worker.busy.size()) < tilesPerWorker) {
+                int index = pending.front();
+                pending.pop_front();
+                worker.busy.push_back(index);
+
+                const Tile& tile = tiles[index];
+                std::ostringstream message;
+                message << "TILE " << index << " " << tile.x0 << " " << tile.y0 << " " << tile.x1 << " " << tile.y1;
+                alive = worker.socket.sendLine(message.str());
+            }
+            if (!alive) {
+                dropWorker(i);
+            }
+        }
+    }
+};
+
+
+#endif //RAY_TRACER_RENDERCOORDINATOR_H
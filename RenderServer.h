@@ -0,0 +1,292 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_RENDERSERVER_H
+#define RAY_TRACER_RENDERSERVER_H
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Film.h"
+#include "Hash.h"
+#include "Parser.h"
+#include "RayTracer.h"
+#include "Socket.h"
+
+// Long-lived render process listening on a Unix domain socket. Parsed scenes are cached by the path and
+// contents of the scene file, and reloaded when a mesh file they load changes. The RayTracer is kept between
+// jobs, so per-job cost is tracing only.
+//
+// Protocol: clients send one job per line,
+//     render <scene file> [size <w> <h>] [scale <factor>] [crop <x0> <y0> <x1> <y1>]
+//            [camera <eye xyz> <center xyz> <up xyz> <fovy>] [spp <samples per pixel>]
+//            [lightcolor <light index> <r g b>]... [material <object index> <kd rgb> <ks rgb> <shininess>
+//            <emission rgb>]... [reshade]
+// where scale multiplies the image size, crop limits the render to a window given as fractions of the
+// image, lightcolor recolors a light and material replaces an object's material for this job. With reshade,
+// the server keeps the job's primary hits (see ShadingCache), and a following reshade job with the same view
+// of the same scene re-shades them instead of tracing, which makes light and material edits cheap. Only one
+// view is kept; it is freed as soon as a job renders another one. The server answers with "OK <w> <h>
+// <tiles>" (the full image size), then for every finished tile a line
+// "TILE <x0> <y0> <x1> <y1>" followed by (x1-x0)*(y1-y0) RGB float32 triples in row-major order,
+// and finally "DONE <seconds>". Failures are reported as "ERROR <message>". "shutdown" stops the server.
+class RenderServer {
+public:
+    RenderServer(const std::string& socketPath, int threadCount = 0, bool pinThreads = false) : socketPath(socketPath) {
+        rayTracer.setThreadCount(threadCount, pinThreads); // Workers stay alive for the server's lifetime
+        rayTracer.deterministic = true; // Identical jobs return identical bytes, so clients can deduplicate frames
+    }
+
+    void run() {
+        Socket listener = Socket::listenUnix(socketPath);
+        std::cout << "Render server listening on " << socketPath << std::endl;
+
+        bool running = true;
+        while (running) {
+            Socket client = listener.accept();
+            std::string line;
+            while (running && client.readLine(line)) {
+                std::istringstream iss(line);
+                std::string command;
+                iss >> command;
+                if (command == "render") {
+                    handleRender(client, iss);
+                } else if (command == "shutdown") {
+                    client.sendLine("OK");
+                    running = false;
+                } else if (!command.empty()) {
+                    client.sendLine("ERROR unknown command " + command);
+                }
+            }
+        }
+        ::unlink(socketPath.c_str());
+    }
+
+private:
+    // A parsed scene together with the camera, light colors and materials it was authored with, so per-job
+    // overrides can be undone
+    struct CachedScene {
+        Scene scene;
+        Vector3 eyePosition, lookAt, up;
+        float fovy;
+        int width, height;
+        int samplesPerPixel;
+        std::vector<Vector3> lightColors;
+        std::vector<std::string> meshFilenames;
+        uint64_t meshHash; // Sizes and modification times of the mesh files when the scene was parsed
+        // Objects the last job gave another material, each with the material it had before
+        std::vector<std::pair<size_t, Material>> editedMaterials;
+    };
+
+    std::string socketPath;
+    std::map<uint64_t, std::shared_ptr<CachedScene>> scenes; // Keyed by path and content hash
+    RayTracer rayTracer;
+    ShadingCache shadingCache;                  // Primary hits of the last reshade job's view
+    std::shared_ptr<CachedScene> shadingScene;  // The scene they were recorded for
+
+    std::shared_ptr<CachedScene> loadScene(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Unable to open file");
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        // The path is part of the key, since relative mesh paths resolve against the scene file's directory
+        uint64_t hash = hashBytes(contents.str(), hashBytes(filename));
+
+        auto it = scenes.find(hash);
+        if (it != scenes.end()) {
+            if (hashMeshFiles(it->second->meshFilenames) == it->second->meshHash) {
+                std::cout << "Scene cache hit for " << filename << std::endl;
+                return it->second;
+            }
+            std::cout << "Mesh files of " << filename << " changed, reloading it" << std::endl;
+            scenes.erase(it);
+        }
+
+        std::shared_ptr<CachedScene> cached(new CachedScene());
+        Parser parser;
+        cached->scene = parser.parseFile(filename, &rayTracer.threadPool());
+        cached->meshFilenames = parser.getMeshFilenames();
+        cached->meshHash = hashMeshFiles(cached->meshFilenames);
+        cached->eyePosition = cached->scene.eyePosition;
+        cached->lookAt = cached->scene.lookAt;
+        cached->up = cached->scene.up;
+        cached->fovy = cached->scene.fovy;
+        cached->width = cached->scene.width;
+        cached->height = cached->scene.height;
+        cached->samplesPerPixel = cached->scene.samplesPerPixel;
+        for (const std::shared_ptr<Light>& light : cached->scene.lights) {
+            cached->lightColors.push_back(light->color);
+        }
+        scenes[hash] = cached;
+        return cached;
+    }
+
+    static uint64_t hashMeshFiles(const std::vector<std::string>& filenames) {
+        uint64_t hash = hashBytes("");
+        for (const std::string& filename : filenames) {
+            hash = hashFileStamp(filename, hash);
+        }
+        return hash;
+    }
+
+    void handleRender(Socket& client, std::istringstream& args) {
+        std::string filename;
+        args >> filename;
+
+        std::shared_ptr<CachedScene> cached;
+        try {
+            cached = loadScene(filename);
+        } catch (const std::exception& e) {
+            client.sendLine("ERROR " + std::string(e.what()) + ": " + filename);
+            return;
+        }
+
+        // Start from the scene's own camera, then apply this job's overrides
+        Scene& scene = cached->scene;
+        scene.eyePosition = cached->eyePosition;
+        scene.lookAt = cached->lookAt;
+        scene.up = cached->up;
+        scene.fovy = cached->fovy;
+        scene.width = cached->width;
+        scene.height = cached->height;
+        scene.samplesPerPixel = cached->samplesPerPixel;
+        for (size_t i = 0; i < scene.lights.size(); i++) {
+            scene.lights[i]->color = cached->lightColors[i];
+        }
+        for (auto edited = cached->editedMaterials.rbegin(); edited != cached->editedMaterials.rend(); ++edited) {
+            scene.objects[edited->first]->material = edited->second; // Backwards, in case an object was edited twice
+        }
+        cached->editedMaterials.clear();
+        bool reshade = false;
+        scene.setCropWindow(0.0f, 0.0f, 1.0f, 1.0f);
+        float scale = 1.0f;
+
+        std::string option;
+        while (args >> option) {
+            if (option == "size") {
+                args >> scene.width >> scene.height;
+            } else if (option == "scale") {
+                args >> scale;
+            } else if (option == "crop") {
+                float x0, y0, x1, y1;
+                args >> x0 >> y0 >> x1 >> y1;
+                scene.setCropWindow(x0, y0, x1, y1);
+            } else if (option == "camera") {
+                float ex, ey, ez, cx, cy, cz, ux, uy, uz, fovy;
+                args >> ex >> ey >> ez >> cx >> cy >> cz >> ux >> uy >> uz >> fovy;
+                scene.setEyePosition(Vector3(ex, ey, ez));
+                scene.setLookAt(Vector3(cx, cy, cz));
+                scene.setUp(Vector3(ux, uy, uz));
+                scene.fovy = fovy;
+            } else if (option == "spp") {
+                int samples;
+                args >> samples;
+                scene.setSamplesPerPixel(samples);
+            } else if (option == "lightcolor") {
+                size_t index;
+                float r, g, b;
+                args >> index >> r >> g >> b;
+                if (!args.fail() && index >= scene.lights.size()) {
+                    client.sendLine("ERROR no light " + std::to_string(index));
+                    return;
+                }
+                if (!args.fail()) {
+                    scene.lights[index]->color = Vector3(r, g, b);
+                }
+            } else if (option == "material") {
+                size_t index;
+                float dr, dg, db, sr, sg, sb, shininess, er, eg, eb;
+                args >> index >> dr >> dg >> db >> sr >> sg >> sb >> shininess >> er >> eg >> eb;
+                if (!args.fail() && index >= scene.objects.size()) {
+                    client.sendLine("ERROR no object " + std::to_string(index));
+                    return;
+                }
+                if (!args.fail() && scene.objects[index]->type == ShapeType::SphereSet) {
+                    // The packed spheres keep their own materials, Shape::material isn't used for shading
+                    client.sendLine("ERROR object " + std::to_string(index) + " is a sphere set");
+                    return;
+                }
+                if (!args.fail()) {
+                    Material& material = scene.objects[index]->material;
+                    cached->editedMaterials.push_back(std::make_pair(index, material));
+                    material = Material(Vector3(dr, dg, db), Vector3(sr, sg, sb), shininess, Vector3(er, eg, eb),
+                                        material.ambient);
+                }
+            } else if (option == "reshade") {
+                reshade = true;
+            } else {
+                client.sendLine("ERROR unknown option " + option);
+                return;
+            }
+            if (args.fail()) {
+                client.sendLine("ERROR malformed " + option + " option");
+                return;
+            }
+        }
+        if (scale > 0.0f && scale != 1.0f) {
+            scene.scaleResolution(scale);
+        }
+        if (scene.width <= 0 || scene.height <= 0 || scale <= 0.0f) {
+            client.sendLine("ERROR invalid image size");
+            return;
+        }
+        if (scene.hasEmptyWindow()) {
+            client.sendLine("ERROR empty crop window");
+            return;
+        }
+        scene.setFovX();
+        scene.updateVirtualScreen();
+
+        Film film(scene.pixelWindow()); // Only the pixels that get sent
+        std::mutex sendMutex;
+        bool connected = client.sendLine("OK " + std::to_string(scene.width) + " " + std::to_string(scene.height) + " " +
+                                         std::to_string(Tile::split(scene.pixelWindow(), rayTracer.tileSize).size()));
+
+        auto startTime = std::chrono::steady_clock::now();
+        // One recorded view at most: drop it once a job looks at anything else
+        if (shadingScene != cached || !shadingCache.fits(scene)) {
+            shadingCache.invalidate();
+            shadingScene.reset();
+        }
+        if (reshade) {
+            shadingScene = cached;
+        }
+        rayTracer.shadingCache = reshade ? &shadingCache : nullptr;
+        rayTracer.trace(scene, film, [&](const Tile& tile) {
+            std::vector<float> data;
+            data.reserve(tile.pixelCount() * 3);
+            for (int y = tile.y0; y < tile.y1; y++) {
+                for (int x = tile.x0; x < tile.x1; x++) {
+                    const Vector3& color = film.pixel(x, y);
+                    data.push_back(color.x);
+                    data.push_back(color.y);
+                    data.push_back(color.z);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(sendMutex);
+            if (!connected) return; // Client went away, finish the frame quietly
+            std::ostringstream header;
+            header << "TILE " << tile.x0 << " " << tile.y0 << " " << tile.x1 << " " << tile.y1;
+            connected = client.sendLine(header.str()) && client.sendAll(data.data(), data.size() * sizeof(float));
+        });
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        if (connected) {
+            client.sendLine("DONE " + std::to_string(seconds));
+        }
+    }
+};
+
+
+#endif //RAY_TRACER_RENDERSERVER_H
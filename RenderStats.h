@@ -0,0 +1,67 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_RENDERSTATS_H
+#define RAY_TRACER_RENDERSTATS_H
+
+#include <iostream>
+
+// Ray and traversal counters, kept per thread. Counting only happens in instrumentation builds
+// (compile with -DRAY_TRACER_STATS); otherwise RT_STAT compiles to nothing and the hot path is untouched.
+class RenderStats {
+public:
+    long long primaryRays = 0;
+    long long shadowRays = 0;
+    long long reflectionRays = 0;
+    long long primitiveTests = 0; // Ray-object intersection tests
+    long long primitiveHits = 0;  // Tests that reported an intersection
+    long long nodeVisits = 0;     // Acceleration structure nodes visited
+
+    // Work done for a ray so far, used for the per-pixel cost heatmap
+    long long cost() const {
+        return primitiveTests + nodeVisits;
+    }
+
+    RenderStats& operator+=(const RenderStats& other) {
+        primaryRays += other.primaryRays;
+        shadowRays += other.shadowRays;
+        reflectionRays += other.reflectionRays;
+        primitiveTests += other.primitiveTests;
+        primitiveHits += other.primitiveHits;
+        nodeVisits += other.nodeVisits;
+        return *this;
+    }
+
+    void print(std::ostream& os, double seconds) const {
+        long long rays = primaryRays + shadowRays + reflectionRays;
+        os << "Render statistics:" << std::endl;
+        os << "  Primary rays: " << primaryRays << std::endl;
+        os << "  Shadow rays: " << shadowRays << std::endl;
+        os << "  Reflection rays: " << reflectionRays << std::endl;
+        os << "  Primitive tests: " << primitiveTests << " (" << primitiveHits << " hits, "
+           << (primitiveTests > 0 ? 100.0 * primitiveHits / primitiveTests : 0.0) << "%)" << std::endl;
+        os << "  Node visits: " << nodeVisits << std::endl;
+        if (rays > 0) {
+            os << "  Tests per ray: " << static_cast<double>(primitiveTests) / rays << std::endl;
+            os << "  Node visits per ray: " << static_cast<double>(nodeVisits) / rays << std::endl;
+        }
+        if (seconds > 0) {
+            os << "  Rays per second: " << rays / seconds << std::endl;
+        }
+    }
+
+    static RenderStats& forThread() {
+        static thread_local RenderStats stats;
+        return stats;
+    }
+};
+
+#ifdef RAY_TRACER_STATS
+#define RT_STAT(counter, amount) (RenderStats::forThread().counter += (amount))
+#else
+#define RT_STAT(counter, amount) ((void)0)
+#endif
+
+
+#endif //RAY_TRACER_RENDERSTATS_H
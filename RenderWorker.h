@@ -0,0 +1,97 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_RENDERWORKER_H
+#define RAY_TRACER_RENDERWORKER_H
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Film.h"
+#include "Parser.h"
+#include "RayTracer.h"
+#include "Socket.h"
+
+// Render process that takes tile assignments from a RenderCoordinator (see there for the protocol).
+// The scene is parsed once per job; every assigned tile is split into smaller tiles for the local pool.
+class RenderWorker {
+public:
+    RenderWorker(const std::string& address, int threadCount = 0, bool pinThreads = false) : address(address) {
+        rayTracer.setThreadCount(threadCount, pinThreads);
+        rayTracer.tileSize = 16; // Assignments are a few times larger, so every local thread gets a share
+        rayTracer.verbose = false;
+        rayTracer.deterministic = true; // Tiles must come out the same whichever worker renders them
+    }
+
+    // Serves tiles until the coordinator sends DONE or goes away
+    void run() {
+        Socket coordinator = Socket::connectTo(address);
+        coordinator.sendLine("HELLO " + std::to_string(rayTracer.threadPool().size()));
+
+        Scene scene;
+        bool loaded = false;
+        int tilesRendered = 0;
+        std::string line;
+        while (coordinator.readLine(line)) {
+            std::istringstream iss(line);
+            std::string command;
+            iss >> command;
+            if (command == "SCENE") {
+                int width, height;
+                std::string filename;
+                iss >> width >> height;
+                std::getline(iss >> std::ws, filename);
+                try {
+                    Parser parser;
+                    scene = parser.parseFile(filename, &rayTracer.threadPool());
+                } catch (const std::exception& e) {
+                    coordinator.sendLine("ERROR " + std::string(e.what()) + ": " + filename);
+                    return;
+                }
+                scene.width = width; // The coordinator's resolution, which may be scaled
+                scene.height = height;
+                loaded = true;
+                coordinator.sendLine("READY");
+            } else if (command == "TILE") {
+                Tile tile;
+                iss >> tile.index >> tile.x0 >> tile.y0 >> tile.x1 >> tile.y1;
+                if (!loaded || iss.fail() || tile.x0 < 0 || tile.y0 < 0 || tile.x1 > scene.width ||
+                    tile.y1 > scene.height) {
+                    coordinator.sendLine("ERROR bad tile " + line);
+                    return;
+                }
+                Film film(tile); // Only the assigned pixels, however large the frame
+                rayTracer.trace(scene, film, Tile::split(tile, rayTracer.tileSize));
+                if (!sendTile(coordinator, film, tile)) return;
+                tilesRendered++;
+            } else if (command == "DONE") {
+                break;
+            }
+        }
+        std::cout << "Worker rendered " << tilesRendered << " tiles" << std::endl;
+    }
+
+private:
+    std::string address;
+    RayTracer rayTracer;
+
+    static bool sendTile(Socket& coordinator, const Film& film, const Tile& tile) {
+        std::vector<float> data;
+        data.reserve(tile.pixelCount() * 3);
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                const Vector3& color = film.pixel(x, y);
+                data.push_back(color.x);
+                data.push_back(color.y);
+                data.push_back(color.z);
+            }
+        }
+        return coordinator.sendLine("RESULT " + std::to_string(tile.index)) &&
+               coordinator.sendAll(data.data(), data.size() * sizeof(float));
+    }
+};
+
+
+#endif //RAY_TRACER_RENDERWORKER_H
@@ -5,11 +5,127 @@
 #ifndef RAY_TRACER_SAMPLER_H
 #define RAY_TRACER_SAMPLER_H
 
+#include <cstdint>
 
+#include "Random.h"
+
+// Low-discrepancy samples from a padded, Owen-scrambled Sobol sequence. Every dimension (or pair of
+// dimensions) of a sample - pixel position, roulette, later light and lobe choices - uses the 2D Sobol
+// points with its own shuffle of the sample index and its own scramble. The dimensions are thus
+// decorrelated from each other, while each of them stays stratified over a pixel's samples. The scrambles
+// are seeded from the pixel and the dimension only, so a pixel's samples don't depend on the thread that
+// renders it or the order of the tiles. Power-of-two sample counts are stratified best.
 class Sampler {
 public:
-    Vector3 getSample(int x, int y) const {
-        return Vector3(x + 0.5f, y + 0.5f, 0);
+    explicit Sampler(int samplesPerPixel = 1, uint32_t seed = 0)
+            : samples(samplesPerPixel > 0 ? samplesPerPixel : 1), seed(seed), pixelX(0), pixelY(0), pixelSeed(0),
+              sampleIndex(0), dimension(0) {}
+
+    int samplesPerPixel() const {
+        return samples;
+    }
+
+    // Starts sample index (0 <= index < samplesPerPixel) of pixel (x, y); dimensions are then drawn in order
+    void startPixelSample(int x, int y, int index) {
+        pixelX = x;
+        pixelY = y;
+        pixelSeed = Random::mix((static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32 | static_cast<uint32_t>(x)) ^
+                                (static_cast<uint64_t>(seed) << 16));
+        sampleIndex = static_cast<uint32_t>(index);
+        dimension = 0;
+    }
+
+    // Next dimension, in [0, 1)
+    float get1D() {
+        uint64_t hash = dimensionHash();
+        uint32_t index = scramble(sampleIndex, static_cast<uint32_t>(hash));
+        return toFloat(scramble(reverseBits(index), static_cast<uint32_t>(hash >> 32)));
+    }
+
+    // Next two dimensions, stratified jointly
+    void get2D(float& u, float& v) {
+        uint64_t hash = dimensionHash();
+        uint32_t index = scramble(sampleIndex, static_cast<uint32_t>(hash));
+        u = toFloat(scramble(reverseBits(index), static_cast<uint32_t>(hash >> 32)));
+        v = toFloat(scramble(sobolSecond(index), static_cast<uint32_t>(Random::mix(hash))));
+    }
+
+    // Set of 2D points, e.g. the shadow rays towards one area light. The index isn't shuffled as in get2D, so
+    // every power-of-two prefix of a set is stratified on its own: a few points can be taken first and the
+    // rest only when they are needed.
+    struct PointSet {
+        uint64_t hash;
+        uint32_t first; // Each pixel sample has its own block of the sequence
+
+        void point(int index, float& u, float& v) const {
+            uint32_t i = first + static_cast<uint32_t>(index);
+            u = toFloat(scramble(reverseBits(i), static_cast<uint32_t>(hash >> 32)));
+            v = toFloat(scramble(sobolSecond(i), static_cast<uint32_t>(hash)));
+        }
+    };
+
+    // Starts a set of size points for the next two dimensions. The sets of all of a pixel's samples together
+    // are stratified as well, when size is a power of two.
+    PointSet startPointSet(int size) {
+        PointSet set = {dimensionHash(), sampleIndex * static_cast<uint32_t>(size)};
+        return set;
+    }
+
+    // Image position of the current sample: the pixel center when there is one sample per pixel (so a
+    // single sample renders exactly as before), otherwise a point spread over the pixel's area
+    Vector3 getPixelSample() {
+        float u, v;
+        get2D(u, v);
+        if (samples == 1) {
+            u = v = 0.5f;
+        }
+        return Vector3(pixelX + u, pixelY + v, 0);
+    }
+
+private:
+    int samples;
+    uint32_t seed;
+    int pixelX, pixelY;
+    uint64_t pixelSeed;   // Hash of the pixel and the sampler's seed
+    uint32_t sampleIndex;
+    uint32_t dimension;   // Dimensions drawn so far for the current sample
+
+    uint64_t dimensionHash() {
+        return Random::mix(pixelSeed + 0x9E3779B97F4A7C15ULL * ++dimension);
+    }
+
+    // Second Sobol dimension (primitive polynomial x + 1); the first is the bit-reversed index
+    static uint32_t sobolSecond(uint32_t index) {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+            if (index & 1) result ^= v;
+        }
+        return result;
+    }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+        x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+        return x;
+    }
+
+    // Nested uniform (Owen) scramble of a binary fraction, using the Laine-Karras hash on the reversed bits
+    // (Burley 2020). Applied to a sample index it shuffles the index within every power-of-two block.
+    static uint32_t scramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverseBits(x);
+    }
+
+    static float toFloat(uint32_t bits) {
+        return (bits >> 8) * (1.0f / 16777216.0f);
     }
 };
 
@@ -5,10 +5,24 @@
 #ifndef RAY_TRACER_SCENE_H
 #define RAY_TRACER_SCENE_H
 
+#include <algorithm>
+#include <cmath>
+
 #include "Ray.h"
 #include "Shape.h"
 #include "Light.h"
 #include "Intersection.h"
+#include "RenderStats.h"
+#include "Arena.h"
+#include "BVH.h"
+#include "ShapeDispatch.h"
+#include "Tile.h"
+
+// Sphere and Triangle own no resources, so arena teardown can skip their (virtual) destructors
+template <>
+struct ArenaSkipsDestructor<Sphere> : std::true_type {};
+template <>
+struct ArenaSkipsDestructor<Triangle> : std::true_type {};
 
 class Scene {
 public:
@@ -21,6 +35,8 @@ public:
     Vector3 topLeft, topRight, bottomLeft, bottomRight; // Corners of the virtual screen
     std::vector<std::shared_ptr<Shape>> objects; // List of objects in the scene
     std::vector<std::shared_ptr<Light>> lights; // List of lights in the scene
+    std::shared_ptr<Arena> arena = std::make_shared<Arena>(); // Owns the objects made with createObject
+    BVH bvh; // Acceleration structure over objects; intersection falls back to a linear scan while it isn't built
 
     float constantAttenuation = 1.0; // Constant attenuation factor
     float linearAttenuation = 0.0;   // Linear attenuation factor
@@ -28,8 +44,26 @@ public:
 
     int maxRecursionDepth = 5;
 
+    float throughputEpsilon = 1e-3f; // Reflection paths stop once their throughput drops below this
+    int russianRouletteDepth = -1;   // Depth from which Russian roulette may terminate paths (-1 = off)
+
+    int samplesPerPixel = 1; // Anti-aliasing; one sample goes through the pixel center
+    int adaptiveShadowSamples = 0; // Area lights take this many shadow rays first, and the rest only in penumbrae (0 = off)
+
+    float lightCutoff = 0.0f; // Many-light mode: skip lights whose attenuated intensity falls below this (0 = off)
+
+    int spherePackingThreshold = 0; // addSpheres() merges the spheres into a SphereSet from this many on (0 = off)
+
+    float cropX0 = 0.0f, cropY0 = 0.0f, cropX1 = 1.0f, cropY1 = 1.0f; // Crop window, as fractions of the image
+
     Scene() = default;
 
+    // Scenes are moved, never copied: a copy would briefly double the memory of a large scene
+    Scene(Scene&&) = default;
+    Scene& operator=(Scene&&) = default;
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+
     Scene(const Vector3& lookfrom, const Vector3& lookat, const Vector3& up, float fovy, int width, int height)
             : eyePosition(lookfrom), lookAt(lookat), up(up), fovy(fovy), width(width), height(height) {
 
@@ -57,6 +91,39 @@ public:
 
     void addObject(const std::shared_ptr<Shape>& object) {
         objects.push_back(object);
+        bvh.clear(); // Stale now, rebuild with buildAccelerationStructure()
+    }
+
+    void buildAccelerationStructure() {
+        bvh.build(objects);
+    }
+
+    // Call after moving objects with Shape::setTransform. Refits the BVH (in parallel when a pool is given)
+    // and only rebuilds it when the refitted tree has degraded too much. Returns true if it was rebuilt.
+    bool updateAccelerationStructure(ThreadPool* pool = nullptr) {
+        return bvh.update(objects, pool);
+    }
+
+    // Allocates an object in the scene's arena. The returned pointer shares the arena's reference count
+    // instead of getting a control block of its own.
+    template <typename T, typename... Args>
+    std::shared_ptr<T> createObject(Args&&... args) {
+        T* object = arena->create<T>(std::forward<Args>(args)...);
+        return std::shared_ptr<T>(arena, object);
+    }
+
+    // Adds the spheres as one SphereSet when there are at least spherePackingThreshold of them, and as
+    // separate objects otherwise. Spheres in a set can't be moved with setTransform afterwards.
+    // Returns true if they were packed.
+    bool addSpheres(const std::vector<Sphere>& spheres) {
+        if (spherePackingThreshold > 0 && spheres.size() >= static_cast<size_t>(spherePackingThreshold)) {
+            addObject(createObject<SphereSet>(spheres));
+            return true;
+        }
+        for (const Sphere& sphere : spheres) {
+            addObject(createObject<Sphere>(sphere));
+        }
+        return false;
     }
 
     void addLight(const std::shared_ptr<Light>& light) {
@@ -78,65 +145,135 @@ public:
 
     Intersection intersect(const Ray& ray) const {
         float closestT = std::numeric_limits<float>::max();
-        Intersection closestIntersection;
+        int closestObject = -1, closestPrimitive = 0;
+        Vector3 closestLocalPoint, closestWorldPoint;
 
-        for (const auto& object : objects) {
+        auto testObject = [&](int index, float& maxDistance) {
+            const Shape& object = *objects[index];
             // Transform the ray into the object's local space
-            Ray localRay = ray.transformedBy(object->getInverseTransform());
+            Ray localRay = ray.transformedBy(object.getInverseTransform());
 
             float currentT;
-            if (object->intersect(localRay, currentT)) {
+            int primitive;
+            RT_STAT(primitiveTests, object.isAggregate() ? 0 : 1);
+            ShapeDispatch::ClosestHit closestHit = {localRay, currentT, primitive};
+            if (ShapeDispatch::visit(object, closestHit)) {
+                RT_STAT(primitiveHits, 1);
                 Vector3 localPoint = localRay.origin + localRay.direction * currentT;
-                Vector3 localNormal = object->normalAt(localPoint);
 
                 // Transform the intersection point back to world space
-                Vector3 worldPoint = object->transform * localPoint;
-                Vector3 worldNormal = object->transform.inverse().transpose() * localNormal;
+                Vector3 worldPoint = object.transform * localPoint;
 
                 // Compute the distance t in world space
                 float worldT = (worldPoint - ray.origin).length();
 
                 if (worldT < closestT) {
-                    closestIntersection = Intersection(worldPoint, worldNormal, object);
+                    closestObject = index;
+                    closestPrimitive = primitive;
+                    closestLocalPoint = localPoint;
+                    closestWorldPoint = worldPoint;
                     closestT = worldT;
+                    maxDistance = worldT; // Nodes beyond the closest hit can be skipped
                 }
             }
+            return false;
+        };
+
+        if (bvh.isBuilt()) {
+            bvh.traverse(ray, closestT, testObject);
+        } else {
+            for (size_t i = 0; i < objects.size(); i++) {
+                float maxDistance = closestT;
+                testObject(static_cast<int>(i), maxDistance);
+            }
+        }
+        if (closestObject < 0) {
+            return Intersection();
         }
 
+        // The normal and material are only needed for the closest hit
+        const Shape* object = objects[closestObject].get();
+        Vector3 localNormal = object->normalAtPrimitive(closestLocalPoint, closestPrimitive);
+        Intersection closestIntersection(closestWorldPoint, object->normalTransform * localNormal, object);
+        closestIntersection.material = object->materialAtPrimitive(closestPrimitive);
+        closestIntersection.objectIndex = closestObject;
+        closestIntersection.primitive = closestPrimitive;
         return closestIntersection;
     }
 
-    bool isShadowed(const Ray& shadowRay, const std::shared_ptr<Light>& light) const {
-        float distanceToLight;
+    float distanceToLight(const Ray& shadowRay, const std::shared_ptr<Light>& light) const {
         if (light->type == Light::Type::Directional) {
-            distanceToLight = std::numeric_limits<float>::infinity(); // Infinite distance for directional lights
-        } else {
-            distanceToLight = (light->position - shadowRay.origin).length(); // Finite distance for point lights
+            return std::numeric_limits<float>::infinity(); // Infinite distance for directional lights
         }
+        return (light->position - shadowRay.origin).length(); // Finite distance for point lights
+    }
 
-        for (const auto& object : objects) {
-            // Transform the shadow ray into the object's local space
-            Ray localShadowRay = shadowRay.transformedBy(object->getInverseTransform());
+    // Checks whether a single object lies between the shadow ray's origin and the light
+    bool occludes(const Shape& object, const Ray& shadowRay, float distanceToLight) const {
+        // Transform the shadow ray into the object's local space
+        Ray localShadowRay = shadowRay.transformedBy(object.getInverseTransform());
+
+        // The light's distance along the local ray, which is normalized again after the transform
+        Vector3 localDirection = object.getInverseTransform() * (shadowRay.origin + shadowRay.direction) -
+                                 object.getInverseTransform() * shadowRay.origin;
+        float currentT = distanceToLight * localDirection.length();
+        RT_STAT(primitiveTests, object.isAggregate() ? 0 : 1);
+        ShapeDispatch::AnyHit anyHit = {localShadowRay, currentT};
+        if (ShapeDispatch::visit(object, anyHit)) {
+            RT_STAT(primitiveHits, 1);
+            // Transform the intersection point back to world space
+            Vector3 localPoint = localShadowRay.origin + localShadowRay.direction * currentT;
+            Vector3 worldPoint = object.transform * localPoint;
+
+            // Compute the distance t in world space
+            float worldT = (worldPoint - shadowRay.origin).length();
+
+            return worldT < distanceToLight;
+        }
+        return false;
+    }
 
-            float currentT = std::numeric_limits<float>::max();
-            if (object->intersect(localShadowRay, currentT)) {
-                // Transform the intersection point back to world space
-                Vector3 localPoint = localShadowRay.origin + localShadowRay.direction * currentT;
-                Vector3 worldPoint = object->transform * localPoint;
+    // If occluder is given, it receives the object that blocked the light (left untouched when unblocked).
+    // Meshes and sphere sets are reported as nullptr: retesting a whole aggregate costs about as much as the
+    // full query, so it isn't worth caching.
+    bool isShadowed(const Ray& shadowRay, const std::shared_ptr<Light>& light, const Shape** occluder = nullptr) const {
+        return isShadowed(shadowRay, distanceToLight(shadowRay, light), occluder);
+    }
 
-                // Compute the distance t in world space
-                float worldT = (worldPoint - shadowRay.origin).length();
+    // Same, for a light (or a point on an area light) maxDistance along the ray
+    bool isShadowed(const Ray& shadowRay, float maxDistance, const Shape** occluder = nullptr) const {
 
-                if (worldT < distanceToLight) {
-                    return true; // There is an object between the point and the light
+        if (bvh.isBuilt()) {
+            bool shadowed = false;
+            bvh.traverse(shadowRay, maxDistance, [&](int index, float&) {
+                if (occludes(*objects[index], shadowRay, maxDistance)) {
+                    if (occluder) *occluder = cacheableOccluder(objects[index].get());
+                    shadowed = true;
+                    return true; // Any occluder will do, stop traversing
                 }
+                return false;
+            });
+            return shadowed;
+        }
+
+        for (const auto& object : objects) {
+            if (occludes(*object, shadowRay, maxDistance)) {
+                if (occluder) *occluder = cacheableOccluder(object.get());
+                return true; // There is an object between the point and the light
             }
         }
         return false; // No objects are blocking the light
     }
 
+    static const Shape* cacheableOccluder(const Shape* object) {
+        return object->isAggregate() ? nullptr : object;
+    }
+
     float attenuation(const Vector3& point, const std::shared_ptr<Light>& light) const {
-        float distance = (light->position - point).length();
+        return attenuation((light->position - point).length());
+    }
+
+    float attenuation(float distance) const {
         return constantAttenuation / (constantAttenuation + linearAttenuation * distance + quadraticAttenuation * distance * distance);
     }
 
@@ -165,6 +302,31 @@ public:
         maxRecursionDepth = depth;
     }
 
+    void setThroughputEpsilon(float epsilon) {
+        throughputEpsilon = epsilon;
+    }
+
+    void setRussianRouletteDepth(int depth) {
+        russianRouletteDepth = depth;
+    }
+
+    void setSamplesPerPixel(int samples) {
+        samplesPerPixel = std::max(1, samples);
+    }
+
+    void setAdaptiveShadowSamples(int samples) {
+        adaptiveShadowSamples = std::max(0, samples);
+    }
+
+    void setLightCutoff(float cutoff) {
+        lightCutoff = cutoff;
+    }
+
+    // Opt-in, since packed spheres can't be moved with setTransform and updateAccelerationStructure
+    void setSpherePackingThreshold(int threshold) {
+        spherePackingThreshold = threshold;
+    }
+
     void setEyePosition(const Vector3& position) {
         eyePosition = position;
     }
@@ -182,6 +344,37 @@ public:
         setFovX();
     }
 
+    // Renders the same view with a different number of pixels, e.g. 0.25 for a quick preview of a 4K frame.
+    // The virtual screen (and fovx) stay as they are; createRay spreads the new pixel grid over it.
+    void scaleResolution(float scale) {
+        width = std::max(1, static_cast<int>(std::lround(width * scale)));
+        height = std::max(1, static_cast<int>(std::lround(height * scale)));
+    }
+
+    // Restricts rendering to part of the image, given as fractions of its width and height
+    void setCropWindow(float x0, float y0, float x1, float y1) {
+        cropX0 = std::max(0.0f, std::min(x0, 1.0f));
+        cropY0 = std::max(0.0f, std::min(y0, 1.0f));
+        cropX1 = std::max(cropX0, std::min(x1, 1.0f));
+        cropY1 = std::max(cropY0, std::min(y1, 1.0f));
+    }
+
+    bool isCropped() const {
+        return cropX0 > 0.0f || cropY0 > 0.0f || cropX1 < 1.0f || cropY1 < 1.0f;
+    }
+
+    // Pixels inside the crop window, the whole image when there is none. Adjacent windows don't overlap.
+    Tile pixelWindow() const {
+        return Tile(static_cast<int>(std::ceil(width * cropX0)), static_cast<int>(std::ceil(height * cropY0)),
+                    static_cast<int>(std::ceil(width * cropX1)), static_cast<int>(std::ceil(height * cropY1)), 0);
+    }
+
+    // True if the crop window doesn't cover a single pixel, e.g. x0 == x1. Check it once the size is final.
+    bool hasEmptyWindow() const {
+        Tile window = pixelWindow();
+        return window.width() <= 0 || window.height() <= 0;
+    }
+
     void setFovX() {
         fovx = 2 * atan(tan(fovy / 2) * ((float)width / (float)height));
     }
@@ -207,6 +400,11 @@ bool operator==(const Scene& lhs, const Scene& rhs) {
     if (lhs.linearAttenuation != rhs.linearAttenuation) return false;
     if (lhs.quadraticAttenuation != rhs.quadraticAttenuation) return false;
     if (lhs.maxRecursionDepth != rhs.maxRecursionDepth) return false;
+    if (lhs.throughputEpsilon != rhs.throughputEpsilon) return false;
+    if (lhs.russianRouletteDepth != rhs.russianRouletteDepth) return false;
+    if (lhs.samplesPerPixel != rhs.samplesPerPixel) return false;
+    if (lhs.adaptiveShadowSamples != rhs.adaptiveShadowSamples) return false;
+    if (lhs.lightCutoff != rhs.lightCutoff) return false;
 
     // Compare objects in the scene
     if (lhs.objects.size() != rhs.objects.size()) return false;
@@ -252,6 +450,11 @@ std::ostream& operator<<(std::ostream& os, const Scene& scene) {
     os << "Bottom Right: " << scene.bottomRight << std::endl;
 
     os << "Max Recursion Depth: " << scene.maxRecursionDepth << std::endl;
+    os << "Throughput Epsilon: " << scene.throughputEpsilon << std::endl;
+    os << "Russian Roulette Depth: " << scene.russianRouletteDepth << std::endl;
+    os << "Samples Per Pixel: " << scene.samplesPerPixel << std::endl;
+    os << "Adaptive Shadow Samples: " << scene.adaptiveShadowSamples << std::endl;
+    os << "Light Cutoff: " << scene.lightCutoff << std::endl;
 
     // Attenuation details
     os << "Attenuation:" << std::endl;
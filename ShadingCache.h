@@ -0,0 +1,153 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_SHADINGCACHE_H
+#define RAY_TRACER_SHADINGCACHE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Intersection.h"
+#include "Light.h"
+#include "Scene.h"
+#include "Tile.h"
+
+// Primary hits of a render, kept for re-shading. When lights or materials are edited while the camera and
+// geometry stay the same, RayTracer::trace rebuilds every primary hit from here instead of tracing it and
+// only runs shading, reflections and shadows again. Each hit also remembers which point and directional
+// lights were visible from it, so if no light moved (only colors changed) those shadow rays are skipped too.
+// The cache can't see objects being moved with setTransform; call invalidate() after doing that.
+class ShadingCache {
+public:
+    enum Visibility : uint8_t {
+        Unknown = 0,
+        Visible,
+        Shadowed
+    };
+
+    // Starts a trace of scene. Returns true if the recorded hits fit it and can be replayed; otherwise the
+    // cache is reset and the trace records into it. Shadow visibility is forgotten if a light moved.
+    bool prepare(const Scene& scene) {
+        Tile window = scene.pixelWindow();
+        lightCount = scene.lights.size();
+        bool sameView = fits(scene);
+        if (!sameView) {
+            invalidate(); // Free the old view before allocating the new one
+            key = Key(scene);
+            hits.assign(static_cast<size_t>(window.pixelCount()) * scene.samplesPerPixel, Hit());
+            visibility.assign(hits.size() * lightCount, Unknown);
+        } else if (lightsMoved(scene)) {
+            visibility.assign(hits.size() * lightCount, Unknown);
+        }
+        lights.clear();
+        for (const std::shared_ptr<Light>& light : scene.lights) {
+            lights.push_back(*light);
+        }
+        return sameView;
+    }
+
+    // True if the recorded hits belong to scene's current view
+    bool fits(const Scene& scene) const {
+        return !hits.empty() && key == Key(scene);
+    }
+
+    // Forgets the recorded hits and frees their memory
+    void invalidate() {
+        std::vector<Hit>().swap(hits);
+        std::vector<uint8_t>().swap(visibility);
+    }
+
+    // Index of a pixel sample inside the traced window
+    size_t sampleIndex(int x, int y, int sample) const {
+        return (static_cast<size_t>(y - key.window.y0) * key.window.width() + (x - key.window.x0)) *
+               key.samplesPerPixel + sample;
+    }
+
+    bool isRecorded(size_t index) const {
+        return hits[index].objectIndex != NotRecorded;
+    }
+
+    void record(size_t index, const Intersection& intersection) {
+        Hit& hit = hits[index];
+        hit.objectIndex = intersection ? intersection.objectIndex : -1;
+        hit.primitive = intersection.primitive;
+        hit.point = intersection.point;
+        hit.normal = intersection.normal;
+    }
+
+    // The recorded hit with the scene's current material
+    Intersection replay(const Scene& scene, size_t index) const {
+        const Hit& hit = hits[index];
+        if (hit.objectIndex < 0) return Intersection();
+        const Shape* object = scene.objects[hit.objectIndex].get();
+        Intersection intersection(hit.point, hit.normal, object);
+        intersection.material = object->materialAtPrimitive(hit.primitive);
+        intersection.objectIndex = hit.objectIndex;
+        intersection.primitive = hit.primitive;
+        return intersection;
+    }
+
+    // One Visibility entry per scene light for the hit
+    uint8_t* lightVisibility(size_t index) {
+        return lightCount > 0 ? &visibility[index * lightCount] : nullptr;
+    }
+
+    size_t hitCount() const {
+        return hits.size();
+    }
+
+private:
+    static const int NotRecorded = -2;
+
+    struct Hit {
+        int objectIndex = NotRecorded; // -1 for rays that escaped
+        int primitive = 0;
+        Vector3 point, normal;
+    };
+
+    // Everything the primary hits depend on
+    struct Key {
+        Vector3 eyePosition, topLeft, topRight, bottomLeft;
+        int width = 0, height = 0, samplesPerPixel = 0;
+        Tile window;
+        const void* objects = nullptr;
+        size_t objectCount = 0;
+
+        Key() : window(0, 0, 0, 0, 0) {}
+
+        explicit Key(const Scene& scene)
+                : eyePosition(scene.eyePosition), topLeft(scene.topLeft), topRight(scene.topRight),
+                  bottomLeft(scene.bottomLeft), width(scene.width), height(scene.height),
+                  samplesPerPixel(scene.samplesPerPixel), window(scene.pixelWindow()), objects(scene.objects.data()),
+                  objectCount(scene.objects.size()) {}
+
+        bool operator==(const Key& other) const {
+            return eyePosition == other.eyePosition && topLeft == other.topLeft && topRight == other.topRight &&
+                   bottomLeft == other.bottomLeft && width == other.width && height == other.height &&
+                   samplesPerPixel == other.samplesPerPixel && window.x0 == other.window.x0 &&
+                   window.y0 == other.window.y0 && window.x1 == other.window.x1 && window.y1 == other.window.y1 &&
+                   objects == other.objects && objectCount == other.objectCount;
+        }
+    };
+
+    Key key;
+    std::vector<Hit> hits;            // Per pixel sample of the window
+    std::vector<uint8_t> visibility;  // Per hit and light
+    size_t lightCount = 0;
+    std::vector<Light> lights;        // The lights visibility was recorded for
+
+    // Any change but the color makes the recorded visibility stale
+    bool lightsMoved(const Scene& scene) const {
+        if (scene.lights.size() != lights.size()) return true;
+        for (size_t i = 0; i < lights.size(); i++) {
+            Light moved = *scene.lights[i];
+            moved.color = lights[i].color;
+            if (!(moved == lights[i])) return true;
+        }
+        return false;
+    }
+};
+
+
+#endif //RAY_TRACER_SHADINGCACHE_H
@@ -0,0 +1,55 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_SHADOWCACHE_H
+#define RAY_TRACER_SHADOWCACHE_H
+
+#include <algorithm>
+#include <vector>
+
+#include "Scene.h"
+
+// Remembers, per light, the last object that blocked a shadow ray. Neighbouring pixels are usually
+// shadowed by the same object, so testing it first often answers the query without scanning the scene.
+// Each render thread owns its own cache, so no synchronization is needed.
+class ShadowCache {
+public:
+    long long lookups; // Shadow queries that had a cached occluder to try
+    long long hits;    // Queries answered by the cached occluder alone
+
+    explicit ShadowCache(size_t lightCount) : lookups(0), hits(0), lastOccluder(lightCount, nullptr) {}
+
+    bool isShadowed(const Scene& scene, const Ray& shadowRay, size_t lightIndex) {
+        return isShadowed(scene, shadowRay, lightIndex, scene.distanceToLight(shadowRay, scene.lights[lightIndex]));
+    }
+
+    // Shadow ray towards a point maxDistance away, e.g. a sample on an area light
+    bool isShadowed(const Scene& scene, const Ray& shadowRay, size_t lightIndex, float maxDistance) {
+        const Shape*& occluder = lastOccluder[lightIndex];
+
+        if (occluder != nullptr) {
+            lookups++;
+            if (scene.occludes(*occluder, shadowRay, maxDistance)) {
+                hits++;
+                return true;
+            }
+        }
+        return scene.isShadowed(shadowRay, maxDistance, &occluder); // Full query, refreshing the cached occluder
+    }
+
+    // Forgets the cached occluders, keeping the counters
+    void reset() {
+        std::fill(lastOccluder.begin(), lastOccluder.end(), nullptr);
+    }
+
+    float hitRate() const {
+        return lookups > 0 ? static_cast<float>(hits) / lookups : 0.0f;
+    }
+
+private:
+    std::vector<const Shape*> lastOccluder; // Indexed like scene.lights
+};
+
+
+#endif //RAY_TRACER_SHADOWCACHE_H
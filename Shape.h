@@ -7,12 +7,16 @@
 
 #include "Material.h"
 #include "Transform.h"
+#include "BoundingBox.h"
 
 #include <sstream>
 
 enum class ShapeType {
     Triangle,
-    Sphere
+    Sphere,
+    Mesh,
+    SphereSet,
+    Custom // Shapes defined outside the renderer; intersected through the virtual interface only
 };
 
 class Shape {
@@ -20,13 +24,52 @@ public:
     Material material; // Material of the shape
     ShapeType type;
     Matrix4x4 transform; // Transform of the shape
+    Matrix4x4 inverseTransform; // Cached inverse of transform, maps world-space rays into object space
+    Matrix4x4 normalTransform;  // Cached inverse transpose of transform, maps object-space normals to world space
 
     Shape(const Material& material, ShapeType type) : material(material), type(type) {}
 
+    // Meshes and sphere sets hold many primitives and count their own primitive tests
+    bool isAggregate() const {
+        return type == ShapeType::Mesh || type == ShapeType::SphereSet;
+    }
+
     virtual bool intersect(const Ray& ray, float& t) const = 0; // Pure virtual method
 
     virtual Vector3 normalAt(const Vector3& point) const = 0; // Pure virtual method to calculate the normal
 
+    virtual BoundingBox bounds() const = 0; // World-space bounds, including the shape's transform
+
+    // Shapes made of many primitives (meshes) also report which one was hit, and get it back in
+    // normalAtPrimitive. Single-primitive shapes just use intersect and normalAt.
+    virtual bool intersectPrimitive(const Ray& ray, float& t, int& primitive) const {
+        primitive = 0;
+        return intersect(ray, t);
+    }
+
+    virtual Vector3 normalAtPrimitive(const Vector3& point, int primitive) const {
+        (void)primitive;
+        return normalAt(point);
+    }
+
+    // Position of a primitive in the input the shape was built from (a mesh's triangles, a sphere set's
+    // spheres), for the primitiveId AOV. Differs from the primitive id where the shape reorders its primitives.
+    virtual int sourcePrimitive(int primitive) const {
+        return primitive;
+    }
+
+    // Shadow query: looks for any hit closer than t (in/out, along the local ray). Shapes made of many
+    // primitives stop at the first one found; the default just returns the closest hit.
+    virtual bool intersectAny(const Ray& ray, float& t) const {
+        return intersect(ray, t);
+    }
+
+    // Shapes whose primitives have their own materials (sphere sets) override this
+    virtual const Material& materialAtPrimitive(int primitive) const {
+        (void)primitive;
+        return material;
+    }
+
     virtual std::string toString() const {
         std::ostringstream oss;
         oss << "- Material properties: " << material << ",\n";
@@ -38,6 +81,8 @@ public:
         // Only allow setTransform on Sphere objects
         if (type == ShapeType::Sphere) {
             transform = t;
+            inverseTransform = t.inverse();
+            normalTransform = inverseTransform.transpose();
         }
     }
 
@@ -45,8 +90,8 @@ public:
         return transform;
     }
 
-    Matrix4x4 getInverseTransform() const {
-        return transform.inverse();
+    const Matrix4x4& getInverseTransform() const {
+        return inverseTransform;
     }
 
     virtual ~Shape() = default; // Virtual destructor
@@ -0,0 +1,94 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_SHAPEDISPATCH_H
+#define RAY_TRACER_SHAPEDISPATCH_H
+
+#include "Mesh.h"
+#include "Sphere.h"
+#include "SphereSet.h"
+#include "Triangle.h"
+
+// Static dispatch on ShapeType for the hot intersection calls. The built-in shapes are final, so once the
+// switch has cast to the concrete type the calls below bind directly and can be inlined into the traversal
+// loops. ShapeType::Custom (extension shapes) takes the virtual interface as the slow path.
+class ShapeDispatch {
+public:
+    // Single-primitive shapes only implement intersect and normalAt
+    template <typename T>
+    static bool intersectPrimitive(const T& shape, const Ray& ray, float& t, int& primitive) {
+        primitive = 0;
+        return shape.intersect(ray, t);
+    }
+
+    static bool intersectPrimitive(const Mesh& shape, const Ray& ray, float& t, int& primitive) {
+        return shape.intersectPrimitive(ray, t, primitive);
+    }
+
+    static bool intersectPrimitive(const SphereSet& shape, const Ray& ray, float& t, int& primitive) {
+        return shape.intersectPrimitive(ray, t, primitive);
+    }
+
+    static bool intersectPrimitive(const Shape& shape, const Ray& ray, float& t, int& primitive) {
+        return shape.intersectPrimitive(ray, t, primitive);
+    }
+
+    template <typename T>
+    static bool intersectAny(const T& shape, const Ray& ray, float& t) {
+        return shape.intersect(ray, t);
+    }
+
+    static bool intersectAny(const Mesh& shape, const Ray& ray, float& t) {
+        return shape.intersectAny(ray, t);
+    }
+
+    static bool intersectAny(const SphereSet& shape, const Ray& ray, float& t) {
+        return shape.intersectAny(ray, t);
+    }
+
+    static bool intersectAny(const Shape& shape, const Ray& ray, float& t) {
+        return shape.intersectAny(ray, t);
+    }
+
+    // Calls visitor(concrete shape) and returns its result
+    template <typename Visitor>
+    static bool visit(const Shape& shape, Visitor& visitor) {
+        switch (shape.type) {
+            case ShapeType::Sphere:
+                return visitor(static_cast<const Sphere&>(shape));
+            case ShapeType::Triangle:
+                return visitor(static_cast<const Triangle&>(shape));
+            case ShapeType::Mesh:
+                return visitor(static_cast<const Mesh&>(shape));
+            case ShapeType::SphereSet:
+                return visitor(static_cast<const SphereSet&>(shape));
+            default:
+                return visitor(shape);
+        }
+    }
+
+    struct ClosestHit {
+        const Ray& ray;
+        float& t;
+        int& primitive;
+
+        template <typename T>
+        bool operator()(const T& shape) const {
+            return intersectPrimitive(shape, ray, t, primitive);
+        }
+    };
+
+    struct AnyHit {
+        const Ray& ray;
+        float& t;
+
+        template <typename T>
+        bool operator()(const T& shape) const {
+            return intersectAny(shape, ray, t);
+        }
+    };
+};
+
+
+#endif //RAY_TRACER_SHAPEDISPATCH_H
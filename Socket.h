@@ -0,0 +1,237 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_SOCKET_H
+#define RAY_TRACER_SOCKET_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Minimal owning wrapper around a POSIX stream socket with blocking, whole-buffer reads and writes.
+// Setup failures throw std::runtime_error; I/O failures (usually a vanished peer) return false.
+class Socket {
+public:
+    Socket() : fd(-1) {}
+    explicit Socket(int fd) : fd(fd) {}
+
+    Socket(Socket&& other) : fd(other.fd), readBuffer(std::move(other.readBuffer)) {
+        other.fd = -1;
+    }
+
+    Socket& operator=(Socket&& other) {
+        if (this != &other) {
+            close();
+            fd = other.fd;
+            readBuffer = std::move(other.readBuffer);
+            other.fd = -1;
+        }
+        return *this;
+    }
+
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    ~Socket() {
+        close();
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    int descriptor() const {
+        return fd;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    bool sendAll(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL); // A closed peer must not kill us with SIGPIPE
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    bool sendLine(const std::string& line) {
+        std::string message = line + "\n";
+        return sendAll(message.data(), message.size());
+    }
+
+    bool recvAll(void* data, size_t size) {
+        char* bytes = static_cast<char*>(data);
+        // Bytes already pulled in by readLine come first
+        size_t buffered = std::min(size, readBuffer.size());
+        std::memcpy(bytes, readBuffer.data(), buffered);
+        readBuffer.erase(0, buffered);
+        bytes += buffered;
+        size -= buffered;
+
+        while (size > 0) {
+            ssize_t received = ::recv(fd, bytes, size, 0);
+            if (received <= 0) return false;
+            bytes += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    // Reads up to the next '\n' (not included in line). Returns false once the peer has closed.
+    bool readLine(std::string& line) {
+        size_t newline;
+        while ((newline = readBuffer.find('\n')) == std::string::npos) {
+            char chunk[4096];
+            ssize_t received = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (received <= 0) return false;
+            readBuffer.append(chunk, static_cast<size_t>(received));
+        }
+        line = readBuffer.substr(0, newline);
+        readBuffer.erase(0, newline + 1);
+        return true;
+    }
+
+    // True if a whole line is already buffered, i.e. readLine won't touch the socket. poll() can't see these.
+    bool hasBufferedLine() const {
+        return readBuffer.find('\n') != std::string::npos;
+    }
+
+    Socket accept() {
+        int client = ::accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            throw std::runtime_error("accept failed: " + std::string(std::strerror(errno)));
+        }
+        tuneTcp(client);
+        return Socket(client);
+    }
+
+    // Binds a Unix domain socket at path, replacing any stale socket file left by an earlier run
+    static Socket listenUnix(const std::string& path) {
+        sockaddr_un address = unixAddress(path);
+        Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!socket.isOpen()) {
+            throw std::runtime_error("Unable to create socket");
+        }
+        ::unlink(path.c_str());
+        if (::bind(socket.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            ::listen(socket.fd, 16) < 0) {
+            throw std::runtime_error("Unable to listen on " + path + ": " + std::strerror(errno));
+        }
+        return socket;
+    }
+
+    static Socket connectUnix(const std::string& path) {
+        sockaddr_un address = unixAddress(path);
+        Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!socket.isOpen() || ::connect(socket.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            throw std::runtime_error("Unable to connect to " + path + ": " + std::strerror(errno));
+        }
+        return socket;
+    }
+
+    // Listens on "host:port" over TCP, e.g. "0.0.0.0:7000" for all interfaces
+    static Socket listenTcp(const std::string& hostAndPort) {
+        addrinfo* info = resolve(hostAndPort, true);
+        Socket socket(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+        int reuse = 1;
+        if (socket.isOpen()) {
+            ::setsockopt(socket.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        }
+        bool ok = socket.isOpen() && ::bind(socket.fd, info->ai_addr, info->ai_addrlen) == 0 && ::listen(socket.fd, 64) == 0;
+        ::freeaddrinfo(info);
+        if (!ok) {
+            throw std::runtime_error("Unable to listen on " + hostAndPort + ": " + std::strerror(errno));
+        }
+        return socket;
+    }
+
+    static Socket connectTcp(const std::string& hostAndPort) {
+        addrinfo* info = resolve(hostAndPort, false);
+        Socket socket(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+        bool ok = socket.isOpen() && ::connect(socket.fd, info->ai_addr, info->ai_addrlen) == 0;
+        ::freeaddrinfo(info);
+        if (!ok) {
+            throw std::runtime_error("Unable to connect to " + hostAndPort + ": " + std::strerror(errno));
+        }
+        tuneTcp(socket.fd);
+        return socket;
+    }
+
+    // "host:port" selects TCP; anything else (or a "unix:" prefix) is a Unix domain socket path
+    static bool isTcpAddress(const std::string& address) {
+        return address.compare(0, 5, "unix:") != 0 && address.find('/') == std::string::npos &&
+               address.find(':') != std::string::npos;
+    }
+
+    static Socket listenOn(const std::string& address) {
+        return isTcpAddress(address) ? listenTcp(address) : listenUnix(unixPath(address));
+    }
+
+    static Socket connectTo(const std::string& address) {
+        return isTcpAddress(address) ? connectTcp(address) : connectUnix(unixPath(address));
+    }
+
+    static std::string unixPath(const std::string& address) {
+        return address.compare(0, 5, "unix:") == 0 ? address.substr(5) : address;
+    }
+
+private:
+    int fd;
+    std::string readBuffer; // Received bytes not yet consumed
+
+    static sockaddr_un unixAddress(const std::string& path) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        std::strcpy(address.sun_path, path.c_str());
+        return address;
+    }
+
+    // No-op on Unix domain sockets, where these options don't apply
+    static void tuneTcp(int fd) {
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Small control messages go out at once
+        ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));  // Notice peers that vanished silently
+    }
+
+    static addrinfo* resolve(const std::string& hostAndPort, bool passive) {
+        size_t colon = hostAndPort.rfind(':');
+        std::string host = hostAndPort.substr(0, colon);
+        std::string port = hostAndPort.substr(colon + 1);
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : 0;
+        addrinfo* info = nullptr;
+        if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info) != 0 || info == nullptr) {
+            throw std::runtime_error("Unable to resolve " + hostAndPort);
+        }
+        return info;
+    }
+};
+
+
+#endif //RAY_TRACER_SOCKET_H
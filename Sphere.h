@@ -10,7 +10,7 @@
 #include <cmath>
 #include <sstream>
 
-class Sphere : public Shape {
+class Sphere final : public Shape {
 public:
     Vector3 center;
     float radius;
@@ -59,6 +59,18 @@ public:
         return (point - center).normalize(); // Normal at a point on a sphere
     }
 
+    BoundingBox bounds() const override {
+        // Transform the corners of the object-space box; their hull bounds the transformed sphere
+        BoundingBox box;
+        for (int i = 0; i < 8; i++) {
+            Vector3 corner(center.x + ((i & 1) ? radius : -radius),
+                           center.y + ((i & 2) ? radius : -radius),
+                           center.z + ((i & 4) ? radius : -radius));
+            box.expand(transform * corner);
+        }
+        return box;
+    }
+
     std::string toString() const override {
         std::ostringstream oss;
         oss << "Sphere with center (" << center.x << ", " << center.y << ", " << center.z << ") and radius " << radius
@@ -0,0 +1,308 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_SPHERESET_H
+#define RAY_TRACER_SPHERESET_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "BVH.h"
+#include "Sphere.h"
+
+// Many spheres stored as one shape in structure-of-arrays form, for particle and molecule scenes. Spheres are
+// split into packs of 8 neighbours by recursive median splits; a BVH over the packs finds the candidates and
+// each pack is tested against the ray in one go (AVX2 when compiled with -mavx2, a plain loop otherwise).
+// Each sphere keeps its own inverse transform and material, so the result matches separate Sphere objects
+// up to rounding.
+class SphereSet final : public Shape {
+public:
+    static const int PackSize = 8;
+
+    explicit SphereSet(const std::vector<Sphere>& spheres)
+            : Shape(spheres.empty() ? Material() : spheres.front().material, ShapeType::SphereSet) {
+        std::vector<BoundingBox> sphereBounds(spheres.size());
+        for (size_t i = 0; i < spheres.size(); i++) {
+            sphereBounds[i] = spheres[i].bounds();
+            setBounds.expand(sphereBounds[i]);
+        }
+
+        // Order the spheres so that every run of PackSize holds close neighbours
+        std::vector<int> order(spheres.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = static_cast<int>(i);
+        }
+        partition(sphereBounds, order, 0, order.size());
+
+        packs.resize((spheres.size() + PackSize - 1) / PackSize);
+        materialIndices.resize(spheres.size());
+        sourceIndices.resize(spheres.size());
+        std::vector<BoundingBox> packBounds(packs.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            const Sphere& sphere = spheres[order[i]];
+            Pack& pack = packs[i / PackSize];
+            int lane = static_cast<int>(i % PackSize);
+            pack.centerX[lane] = sphere.center.x;
+            pack.centerY[lane] = sphere.center.y;
+            pack.centerZ[lane] = sphere.center.z;
+            pack.radiusSquared[lane] = sphere.radius * sphere.radius;
+            for (int row = 0; row < 3; row++) {
+                for (int column = 0; column < 4; column++) {
+                    pack.inverse[row * 4 + column][lane] = sphere.getInverseTransform().m[row][column];
+                }
+            }
+            pack.active[lane] = 1;
+            packBounds[i / PackSize].expand(sphereBounds[order[i]]);
+            materialIndices[i] = materialIndex(sphere.material);
+            sourceIndices[i] = order[i];
+        }
+        bvh.maxLeafSize = 1; // A pack is already 8 spheres
+        bvh.build(packBounds);
+    }
+
+    size_t sphereCount() const {
+        return materialIndices.size();
+    }
+
+    bool intersect(const Ray& ray, float& t) const override {
+        int primitive;
+        return intersectPrimitive(ray, t, primitive);
+    }
+
+    bool intersectAny(const Ray& ray, float& t) const override {
+        bool found = false;
+        bvh.traverse(ray, t, [&](int packIndex, float& maxDistance) {
+            float hit[PackSize];
+            int mask = intersectPack(packs[packIndex], ray, hit);
+            for (int lane = 0; lane < PackSize; lane++) {
+                if ((mask & (1 << lane)) && hit[lane] < maxDistance) {
+                    t = hit[lane];
+                    found = true;
+                    return true; // Any occluder will do
+                }
+            }
+            return false;
+        });
+        return found;
+    }
+
+    bool intersectPrimitive(const Ray& ray, float& t, int& primitive) const override {
+        float closest = std::numeric_limits<float>::max();
+        primitive = -1;
+        bvh.traverse(ray, closest, [&](int packIndex, float& maxDistance) {
+            float hit[PackSize];
+            int mask = intersectPack(packs[packIndex], ray, hit);
+            for (int lane = 0; lane < PackSize; lane++) {
+                if ((mask & (1 << lane)) && hit[lane] < maxDistance) {
+                    maxDistance = hit[lane];
+                    closest = hit[lane];
+                    primitive = packIndex * PackSize + lane;
+                }
+            }
+            return false;
+        });
+        t = closest;
+        return primitive >= 0;
+    }
+
+    // The set itself has the identity transform, so point is in world space. Like Sphere, the normal is the
+    // object-space normal mapped by the sphere's inverse transpose.
+    Vector3 normalAtPrimitive(const Vector3& point, int primitive) const override {
+        const Pack& pack = packs[primitive / PackSize];
+        int lane = primitive % PackSize;
+        Matrix4x4 inverse;
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 4; column++) {
+                inverse.m[row][column] = pack.inverse[row * 4 + column][lane];
+            }
+        }
+        Vector3 localPoint = inverse * point;
+        Vector3 center(pack.centerX[lane], pack.centerY[lane], pack.centerZ[lane]);
+        return inverse.transpose() * (localPoint - center).normalize();
+    }
+
+    const Material& materialAtPrimitive(int primitive) const override {
+        return materials[materialIndices[primitive]];
+    }
+
+    // Primitive ids follow the packs; this maps one back to the sphere's index in the constructor's vector
+    int sourcePrimitive(int primitive) const override {
+        return sourceIndices[primitive];
+    }
+
+    // Without the primitive id, the sphere whose surface is closest to the point is looked up. Slow; the
+    // scene always goes through normalAtPrimitive.
+    Vector3 normalAt(const Vector3& point) const override {
+        int best = 0;
+        float bestDistance = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < sphereCount(); i++) {
+            const Pack& pack = packs[i / PackSize];
+            int lane = static_cast<int>(i % PackSize);
+            Vector3 offset = point - Vector3(pack.centerX[lane], pack.centerY[lane], pack.centerZ[lane]);
+            float distance = std::abs(offset.length() - std::sqrt(pack.radiusSquared[lane]));
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = static_cast<int>(i);
+            }
+        }
+        return normalAtPrimitive(point, best);
+    }
+
+    BoundingBox bounds() const override {
+        return setBounds;
+    }
+
+    std::string toString() const override {
+        std::ostringstream oss;
+        oss << "SphereSet with " << sphereCount() << " spheres in " << packs.size() << " packs and "
+            << materials.size() << " materials\n" << Shape::toString();
+        return oss.str();
+    }
+
+private:
+    // PackSize spheres, one per lane. Unused lanes of the last pack have active = 0.
+    struct Pack {
+        float centerX[PackSize], centerY[PackSize], centerZ[PackSize];
+        float radiusSquared[PackSize];
+        float inverse[12][PackSize]; // Top three rows of each sphere's inverse transform, row-major
+        int active[PackSize];
+
+        Pack() {
+            std::fill(&centerX[0], &centerX[0] + PackSize, 0.0f);
+            std::fill(&centerY[0], &centerY[0] + PackSize, 0.0f);
+            std::fill(&centerZ[0], &centerZ[0] + PackSize, 0.0f);
+            std::fill(&radiusSquared[0], &radiusSquared[0] + PackSize, 0.0f);
+            std::fill(&inverse[0][0], &inverse[0][0] + 12 * PackSize, 0.0f);
+            std::fill(&active[0], &active[0] + PackSize, 0);
+        }
+    };
+
+    std::vector<Pack> packs;        // Sphere i is lane i % PackSize of pack i / PackSize
+    std::vector<int> materialIndices; // Per sphere, into materials
+    std::vector<int> sourceIndices;   // Per sphere, its index in the vector the set was built from
+    std::vector<Material> materials;
+    BVH bvh; // Over packs
+    BoundingBox setBounds;
+
+    int materialIndex(const Material& material) {
+        for (size_t i = 0; i < materials.size(); i++) {
+            if (materials[i] == material) return static_cast<int>(i);
+        }
+        materials.push_back(material);
+        return static_cast<int>(materials.size() - 1);
+    }
+
+    // Median split along the widest axis of the centroids, at a multiple of PackSize, until ranges fit a pack
+    static void partition(const std::vector<BoundingBox>& sphereBounds, std::vector<int>& order, size_t first,
+                          size_t last) {
+        if (last - first <= static_cast<size_t>(PackSize)) return;
+        BoundingBox centroids;
+        for (size_t i = first; i < last; i++) {
+            centroids.expand(sphereBounds[order[i]].centroid());
+        }
+        Vector3 extent = centroids.extent();
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        size_t packCount = (last - first + PackSize - 1) / PackSize;
+        size_t middle = first + packCount / 2 * PackSize;
+        std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [&](int a, int b) {
+            return axisOf(sphereBounds[a].centroid(), axis) < axisOf(sphereBounds[b].centroid(), axis);
+        });
+        partition(sphereBounds, order, first, middle);
+        partition(sphereBounds, order, middle, last);
+    }
+
+    // Tests the ray against every sphere of the pack, each in its own object space as Sphere::intersect does.
+    // The ray parameter is unchanged by the affine map, so hit[lane] is the distance along the world ray.
+    // Returns a bit mask of the lanes that were hit.
+    static int intersectPack(const Pack& pack, const Ray& ray, float* hit) {
+        RT_STAT(primitiveTests, PackSize);
+#ifdef __AVX2__
+        const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y),
+                oz = _mm256_set1_ps(ray.origin.z);
+        const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y),
+                dz = _mm256_set1_ps(ray.direction.z);
+        auto row = [&](int r, __m256& origin, __m256& direction) {
+            __m256 m0 = _mm256_loadu_ps(pack.inverse[r * 4 + 0]), m1 = _mm256_loadu_ps(pack.inverse[r * 4 + 1]);
+            __m256 m2 = _mm256_loadu_ps(pack.inverse[r * 4 + 2]), m3 = _mm256_loadu_ps(pack.inverse[r * 4 + 3]);
+            direction = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, dx), _mm256_mul_ps(m1, dy)),
+                                      _mm256_mul_ps(m2, dz));
+            origin = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, ox), _mm256_mul_ps(m1, oy)),
+                                                 _mm256_mul_ps(m2, oz)), m3);
+        };
+        __m256 lox, loy, loz, ldx, ldy, ldz;
+        row(0, lox, ldx);
+        row(1, loy, ldy);
+        row(2, loz, ldz);
+        __m256 ocx = _mm256_sub_ps(lox, _mm256_loadu_ps(pack.centerX));
+        __m256 ocy = _mm256_sub_ps(loy, _mm256_loadu_ps(pack.centerY));
+        __m256 ocz = _mm256_sub_ps(loz, _mm256_loadu_ps(pack.centerZ));
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ldx, ldx), _mm256_mul_ps(ldy, ldy)),
+                                 _mm256_mul_ps(ldz, ldz));
+        __m256 halfB = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ldx), _mm256_mul_ps(ocy, ldy)),
+                                     _mm256_mul_ps(ocz, ldz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+                                               _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(pack.radiusSquared));
+        __m256 b = _mm256_add_ps(halfB, halfB);
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b),
+                                            _mm256_mul_ps(_mm256_set1_ps(4.0f), _mm256_mul_ps(a, c)));
+        __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+        __m256 twoA = _mm256_add_ps(a, a);
+        __m256 negB = _mm256_sub_ps(_mm256_setzero_ps(), b);
+        __m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, root), twoA);
+        __m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, root), twoA);
+        __m256 zero = _mm256_setzero_ps();
+        __m256 nearPositive = _mm256_cmp_ps(t1, zero, _CMP_GT_OQ);
+        __m256 t = _mm256_blendv_ps(t2, t1, nearPositive);
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ),
+                                     _mm256_or_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ),
+                                                  _mm256_cmp_ps(discriminant, zero, _CMP_EQ_OQ)));
+        _mm256_storeu_ps(hit, t);
+        __m256i active = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pack.active));
+        valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(active, _mm256_setzero_si256())));
+        return _mm256_movemask_ps(valid);
+#else
+        // Same arithmetic lane by lane, written branch-free so the compiler can vectorize it with SSE
+        const float (*m)[PackSize] = pack.inverse;
+        const float ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+        const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+        int valid[PackSize];
+        for (int lane = 0; lane < PackSize; lane++) {
+            float lox = m[0][lane] * ox + m[1][lane] * oy + m[2][lane] * oz + m[3][lane];
+            float loy = m[4][lane] * ox + m[5][lane] * oy + m[6][lane] * oz + m[7][lane];
+            float loz = m[8][lane] * ox + m[9][lane] * oy + m[10][lane] * oz + m[11][lane];
+            float ldx = m[0][lane] * dx + m[1][lane] * dy + m[2][lane] * dz;
+            float ldy = m[4][lane] * dx + m[5][lane] * dy + m[6][lane] * dz;
+            float ldz = m[8][lane] * dx + m[9][lane] * dy + m[10][lane] * dz;
+            float ocx = lox - pack.centerX[lane], ocy = loy - pack.centerY[lane], ocz = loz - pack.centerZ[lane];
+            float a = ldx * ldx + ldy * ldy + ldz * ldz;
+            float halfB = ocx * ldx + ocy * ldy + ocz * ldz;
+            float b = halfB + halfB;
+            float c = ocx * ocx + ocy * ocy + ocz * ocz - pack.radiusSquared[lane];
+            float discriminant = b * b - 4.0f * (a * c);
+            float root = std::sqrt(std::max(discriminant, 0.0f));
+            float t1 = (-b - root) / (a + a);
+            float t2 = (-b + root) / (a + a);
+            float t = t1 > 0.0f ? t1 : t2; // Nearest root in front of the origin, as in Sphere::intersect
+            hit[lane] = t;
+            valid[lane] = pack.active[lane] & (discriminant >= 0.0f) & ((t > 0.0f) | (discriminant == 0.0f));
+        }
+        int mask = 0;
+        for (int lane = 0; lane < PackSize; lane++) {
+            mask |= valid[lane] << lane;
+        }
+        return mask;
+#endif
+    }
+};
+
+
+#endif //RAY_TRACER_SPHERESET_H
@@ -0,0 +1,132 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_THREADPOOL_H
+#define RAY_TRACER_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Fixed set of worker threads that live as long as the pool, so repeated renders (animations, server jobs)
+// don't pay for thread creation. Work is handed out with run() or parallelFor(), which block the caller
+// until every worker is done. Calls are serialized; tasks must not call back into the same pool.
+class ThreadPool {
+public:
+    // threadCount <= 0 uses every hardware thread. pinThreads binds worker i to core i (Linux only).
+    explicit ThreadPool(int threadCount = 0, bool pinThreads = false) : generation(0), pending(0), stopping(false),
+                                                                        currentTask(nullptr) {
+        int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        if (threadCount <= 0) {
+            threadCount = cores;
+        }
+        for (int i = 0; i < threadCount; i++) {
+            workers.push_back(std::thread([this, i]() { workerLoop(i); }));
+            if (pinThreads) {
+                pin(workers.back(), i % cores);
+            }
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return static_cast<int>(workers.size());
+    }
+
+    // Runs task(worker) once on every worker thread, worker being in [0, size())
+    void run(const std::function<void(int worker)>& task) {
+        std::lock_guard<std::mutex> dispatchLock(dispatchMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        currentTask = &task;
+        pending = size();
+        generation++;
+        wake.notify_all();
+        finished.wait(lock, [this]() { return pending == 0; });
+        currentTask = nullptr;
+    }
+
+    // Calls body(index, worker) for every index in [0, count). Indices are handed out dynamically in
+    // chunks of grainSize, so uneven work balances itself. The worker id can index per-thread scratch data.
+    void parallelFor(int count, const std::function<void(int index, int worker)>& body, int grainSize = 1) {
+        if (count <= 0) return;
+        std::atomic<int> next(0);
+        run([&](int worker) {
+            for (int begin = next.fetch_add(grainSize); begin < count; begin = next.fetch_add(grainSize)) {
+                int end = std::min(begin + grainSize, count);
+                for (int i = begin; i < end; i++) {
+                    body(i, worker);
+                }
+            }
+        });
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex dispatchMutex; // Serializes run() calls from different threads
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    unsigned long long generation; // Bumped for every task so workers can tell a new one apart
+    int pending;                   // Workers still running the current task
+    bool stopping;
+    const std::function<void(int)>* currentTask;
+
+    void workerLoop(int worker) {
+        unsigned long long seen = 0;
+        while (true) {
+            const std::function<void(int)>* task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                task = currentTask;
+            }
+
+            (*task)(worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+
+    static void pin(std::thread& thread, int core) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+        (void)thread;
+        (void)core;
+#endif
+    }
+};
+
+
+#endif //RAY_TRACER_THREADPOOL_H
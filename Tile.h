@@ -0,0 +1,51 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_TILE_H
+#define RAY_TRACER_TILE_H
+
+#include <algorithm>
+#include <vector>
+
+// Rectangular block of pixels [x0, x1) x [y0, y1), the unit of work handed to render threads
+class Tile {
+public:
+    int x0, y0, x1, y1;
+    int index; // Position in the list returned by split()
+
+    Tile() : x0(0), y0(0), x1(0), y1(0), index(0) {}
+    Tile(int x0, int y0, int x1, int y1, int index) : x0(x0), y0(y0), x1(x1), y1(y1), index(index) {}
+
+    int width() const {
+        return x1 - x0;
+    }
+
+    int height() const {
+        return y1 - y0;
+    }
+
+    int pixelCount() const {
+        return width() * height();
+    }
+
+    // Covers a width x height image with tiles in row-major order; edge tiles are clipped to the image
+    static std::vector<Tile> split(int width, int height, int tileSize) {
+        return split(Tile(0, 0, width, height, 0), tileSize);
+    }
+
+    // Same for an arbitrary region of the image
+    static std::vector<Tile> split(const Tile& region, int tileSize) {
+        std::vector<Tile> tiles;
+        for (int y = region.y0; y < region.y1; y += tileSize) {
+            for (int x = region.x0; x < region.x1; x += tileSize) {
+                tiles.push_back(Tile(x, y, std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1),
+                                     static_cast<int>(tiles.size())));
+            }
+        }
+        return tiles;
+    }
+};
+
+
+#endif //RAY_TRACER_TILE_H
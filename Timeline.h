@@ -0,0 +1,149 @@
+//
+//
+//
+
+#ifndef RAY_TRACER_TIMELINE_H
+#define RAY_TRACER_TIMELINE_H
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records what each thread is doing over time and exports it as Chrome trace JSON, which can be opened in
+// chrome://tracing or ui.perfetto.dev. Every thread appends to its own fixed-size ring buffer, so recording
+// an event takes no locks; the only lock is taken once per thread, when its buffer is created.
+class Timeline {
+public:
+    struct Event {
+        const char* name; // Must be a string literal (or otherwise outlive the timeline)
+        long long start;  // Microseconds since the timeline was enabled
+        long long duration;
+        int arg;          // Optional integer argument (tile or band index), -1 if unused
+    };
+
+    static Timeline& instance() {
+        static Timeline timeline;
+        return timeline;
+    }
+
+    // eventsPerThread bounds memory use; older events are overwritten once a thread's buffer is full
+    void enable(size_t eventsPerThread = 1 << 16) {
+        capacity = eventsPerThread;
+        epoch = std::chrono::steady_clock::now();
+        enabled = true;
+    }
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+    long long now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void record(const char* name, long long start, long long duration, int arg = -1) {
+        ThreadBuffer*& buffer = threadBuffer();
+        if (buffer == nullptr) {
+            buffer = registerThread();
+        }
+        Event& event = buffer->events[buffer->count % capacity];
+        event.name = name;
+        event.start = start;
+        event.duration = duration;
+        event.arg = arg;
+        buffer->count++;
+    }
+
+    // Call once rendering threads have finished; buffers are read without synchronization
+    void writeJson(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(filename);
+        if (!out.is_open()) {
+            std::cerr << "Unable to write timeline to " << filename << std::endl;
+            return;
+        }
+
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        for (const auto& buffer : buffers) {
+            out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                << ",\"args\":{\"name\":\"thread " << buffer->tid << "\"}}";
+            first = false;
+
+            size_t begin = buffer->count > capacity ? buffer->count - capacity : 0;
+            for (size_t i = begin; i < buffer->count; i++) {
+                const Event& event = buffer->events[i % capacity];
+                out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                    << buffer->tid << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+                if (event.arg >= 0) {
+                    out << ",\"args\":{\"index\":" << event.arg << "}";
+                }
+                out << "}";
+            }
+        }
+        out << "\n]}\n";
+        std::cout << "Timeline written to " << filename << std::endl;
+    }
+
+private:
+    struct ThreadBuffer {
+        int tid;
+        std::vector<Event> events;
+        size_t count; // Total events recorded, may exceed events.size()
+    };
+
+    bool enabled = false;
+    size_t capacity = 0;
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::mutex mutex;
+
+    Timeline() = default;
+
+    static ThreadBuffer*& threadBuffer() {
+        static thread_local ThreadBuffer* buffer = nullptr;
+        return buffer;
+    }
+
+    ThreadBuffer* registerThread() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<ThreadBuffer> buffer(new ThreadBuffer());
+        buffer->tid = static_cast<int>(buffers.size());
+        buffer->events.resize(capacity);
+        buffer->count = 0;
+        buffers.push_back(std::move(buffer));
+        return buffers.back().get();
+    }
+};
+
+// Records the lifetime of a scope as one timeline event. Costs a single branch when the timeline is disabled.
+class TimelineScope {
+public:
+    explicit TimelineScope(const char* name, int arg = -1) : name(name), arg(arg), start(-1) {
+        if (Timeline::instance().isEnabled()) {
+            start = Timeline::instance().now();
+        }
+    }
+
+    ~TimelineScope() {
+        if (start >= 0) {
+            Timeline& timeline = Timeline::instance();
+            timeline.record(name, start, timeline.now() - start, arg);
+        }
+    }
+
+    TimelineScope(const TimelineScope&) = delete;
+    TimelineScope& operator=(const TimelineScope&) = delete;
+
+private:
+    const char* name;
+    int arg;
+    long long start;
+};
+
+
+#endif //RAY_TRACER_TIMELINE_H
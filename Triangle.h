@@ -7,7 +7,7 @@
 
 #include <sstream>
 
-class Triangle : public Shape {
+class Triangle final : public Shape {
 public:
     Vector3 vertex0, vertex1, vertex2; // Vertices of the triangle
 
@@ -59,6 +59,14 @@ public:
         return normal;
     }
 
+    BoundingBox bounds() const override {
+        BoundingBox box; // Triangle vertices are already in world space
+        box.expand(vertex0);
+        box.expand(vertex1);
+        box.expand(vertex2);
+        return box;
+    }
+
     std::string toString() const override {
         std::ostringstream oss;
         oss << "Triangle with vertices (" << vertex0.x << ", " << vertex0.y << ", " << vertex0.z << "), "
@@ -7,6 +7,10 @@
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <random>
 
 #include "Vector3.h"
 #include "Matrix4x4.h"
@@ -19,13 +23,22 @@
 #include "Shape.h"
 #include "Sphere.h"
 #include "Triangle.h"
+#include "Mesh.h"
 #include "Transform.h"
 
 #include "Scene.h"
 #include "Film.h"
 #include "Sampler.h"
+#include "Denoiser.h"
 
 #include "Parser.h"
+#include "Timeline.h"
+#include "RenderServer.h"
+#include "RenderCoordinator.h"
+#include "RenderWorker.h"
+#include "CameraPath.h"
+#include "Checkpoint.h"
+#include "AsyncImageWriter.h"
 
 #include <tuple>
 
@@ -622,6 +635,42 @@ void testTranspose() {
     std::cout << "Transpose test passed!" << std::endl;
 }
 
+// A quad of two mesh triangles, viewed head-on from a distance proportional to its size, must cover the same
+// pixels at any scale. The ray-triangle test used to reject small triangles as parallel to the ray.
+void testTinyTriangles() {
+    const float halfSizes[] = {1.0f, 3e-5f, 1e-5f};
+    int expected = -1;
+    for (float halfSize : halfSizes) {
+        Scene scene(Vector3(0, 0, 4 * halfSize), Vector3(0, 0, 0), Vector3(0, 1, 0), 0.8f, 32, 32);
+        Material material(Vector3(1, 1, 1), Vector3(0, 0, 0), 1.0f, Vector3(0, 0, 0));
+        std::vector<Vector3> vertices = {Vector3(-halfSize, -halfSize, 0), Vector3(halfSize, -halfSize, 0),
+                                         Vector3(halfSize, halfSize, 0), Vector3(-halfSize, halfSize, 0)};
+        auto quad = scene.createObject<Mesh>(std::move(vertices), std::vector<uint32_t>{0, 1, 2, 0, 2, 3}, material);
+        quad->setTransform(Matrix4x4());
+        scene.addObject(quad);
+        scene.buildAccelerationStructure();
+
+        int hits = 0;
+        for (int y = 0; y < scene.height; y++) {
+            for (int x = 0; x < scene.width; x++) {
+                if (scene.intersect(scene.createRay(Vector3(x + 0.5f, y + 0.5f, 0)))) {
+                    hits++;
+                }
+            }
+        }
+        if (expected < 0) {
+            expected = hits;
+        }
+        if (hits == 0 || hits != expected) {
+            std::cerr << "Tiny triangle test failed! Half size " << halfSize << " covers " << hits << " pixels, "
+                      << expected << " expected" << std::endl;
+            return;
+        }
+    }
+
+    std::cout << "Tiny triangle test passed!" << std::endl;
+}
+
 void renderSphereBehindTriangle() {
     Vector3 eye(0, -4, 4);
     Vector3 lookAt(0, 0, -2);
@@ -728,7 +777,169 @@ void renderSpheresBehindEachOtherWithTriangle() {
 
 
 
-int main() {
+// Renders a fly-through with a single parsed scene. Only the camera changes between frames, so the per-frame
+// cost is tracing; each finished frame is encoded on a background thread while the next one is traced.
+void renderAnimation(Scene& scene, RayTracer& rayTracer, const CameraPath& path, int frames, const std::string& output) {
+    AsyncImageWriter writer(1); // At most one frame waits for encoding
+    for (int frame = 0; frame < frames; frame++) {
+        path.apply(scene, static_cast<float>(frame));
+        std::shared_ptr<Film> film = std::make_shared<Film>(scene.width, scene.height);
+        rayTracer.trace(scene, *film);
+        writer.write(film, CameraPath::frameFilename(output, frame));
+    }
+    writer.flush();
+}
+
+// Renders the frame with several thread counts and tile orders in deterministic mode and compares the hashes
+// of the images (denoised too, if asked for). Returns false if any of them differ.
+bool verifyDeterminism(const Scene& scene, bool denoise, int tileSize = 32) {
+    int hardwareThreads = static_cast<int>(std::thread::hardware_concurrency());
+    const int threadCounts[] = {1, 2, std::max(4, hardwareThreads)};
+    std::mt19937 random(2024); // Fixed seed, so a failure can be reproduced
+    uint64_t reference = 0;
+    bool identical = true;
+    for (int run = 0; run < 3; run++) {
+        RayTracer rayTracer;
+        rayTracer.verbose = false;
+        rayTracer.deterministic = true;
+        rayTracer.tileSize = tileSize;
+        rayTracer.setThreadCount(threadCounts[run]);
+        std::vector<Tile> tiles = Tile::split(scene.pixelWindow(), rayTracer.tileSize);
+        if (run > 0) {
+            std::shuffle(tiles.begin(), tiles.end(), random);
+        }
+
+        Film film(scene.pixelWindow());
+        if (denoise) {
+            film.enableFeatureBuffers();
+        }
+        rayTracer.trace(scene, film, tiles);
+        if (denoise) {
+            Denoiser().denoise(film, &rayTracer.threadPool());
+        }
+
+        uint64_t hash = film.hash();
+        if (run == 0) {
+            reference = hash;
+        }
+        identical = identical && hash == reference;
+        std::cout << threadCounts[run] << " threads, " << (run > 0 ? "shuffled" : "in order") << " tiles: "
+                  << std::hex << hash << std::dec << (hash == reference ? "" : " MISMATCH") << std::endl;
+    }
+    std::cout << (identical ? "Renders are identical" : "Renders differ") << std::endl;
+    return identical;
+}
+
+void testDeterminism() {
+    Scene scene(Vector3(0, 3, 8), Vector3(0, 0, 0), Vector3(0, 1, 0), 0.8f, 96, 64);
+    scene.setSamplesPerPixel(4);
+    scene.setMaxRecursionDepth(3);
+    scene.setSpherePackingThreshold(64);
+
+    // Enough spheres to be packed into a SphereSet, half of them mirrors
+    std::vector<Sphere> spheres;
+    for (int i = 0; i < 80; i++) {
+        Material material(Vector3(0.2f + 0.008f * i, 0.5f, 0.9f - 0.01f * i), Vector3(i % 2 == 0 ? 0.5f : 0.0f,
+                          0.3f, 0.3f), 40.0f, Vector3(0, 0, 0));
+        Sphere sphere(Vector3(-4.5f + (i % 10), 0.1f * (i % 3), -3.5f + (i / 10)), 0.35f, material);
+        sphere.setTransform(Matrix4x4());
+        spheres.push_back(sphere);
+    }
+    scene.addSpheres(spheres);
+
+    Material floorMaterial(Vector3(0.8f, 0.8f, 0.8f), Vector3(0.1f, 0.1f, 0.1f), 10.0f, Vector3(0, 0, 0));
+    std::vector<Vector3> floorVertices = {Vector3(-8, -0.4f, -8), Vector3(8, -0.4f, -8), Vector3(8, -0.4f, 8),
+                                          Vector3(-8, -0.4f, 8)};
+    auto floor = scene.createObject<Mesh>(std::move(floorVertices), std::vector<uint32_t>{0, 2, 1, 0, 3, 2},
+                                          floorMaterial);
+    floor->setTransform(Matrix4x4());
+    scene.addObject(floor);
+
+    scene.addLight(Light::makeQuad(Vector3(-1, 4, -1), Vector3(2, 0, 0), Vector3(0, 0, 2), Vector3(0.8f, 0.8f, 0.8f),
+                                   8));
+    scene.addLight(std::make_shared<Light>(Light::Type::Point, Vector3(3, 2, 4), Vector3(0.4f, 0.4f, 0.4f)));
+    scene.buildAccelerationStructure();
+
+    // Small tiles, so the shuffled orders really differ
+    if (verifyDeterminism(scene, true, 16)) {
+        std::cout << "Determinism test passed!" << std::endl;
+    } else {
+        std::cerr << "Determinism test failed!" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string sceneFile = "hw3-submissionscenes/scene1.test";
+    std::string heatmapFile; // Per-pixel cost image, requires a RAY_TRACER_STATS build
+    std::string timelineFile; // Chrome trace JSON of the render phases
+    std::string serverSocket; // Run as a persistent render server on this Unix domain socket
+    int threadCount = 0;      // Render threads, 0 = one per hardware thread
+    bool pinThreads = false;
+    std::string keyframeFile; // Camera path; renders a numbered image sequence instead of a single image
+    int frameCount = 0;       // Frames to render, 0 = up to the last keyframe
+    std::string coordinatorAddress; // Farm tiles out to worker processes connecting here ("host:port" or a socket path)
+    std::string workerAddress;      // Run as a worker for the coordinator at this address
+    int spawnWorkers = 0;           // Worker processes the coordinator starts on this machine
+    std::string checkpointFile;     // Save finished tiles here and resume from it after an interruption
+    double checkpointInterval = 30; // Seconds between checkpoint saves
+    float resolutionScale = 1.0f;   // Multiplies the scene's size, e.g. 0.25 for a quick preview
+    std::vector<float> cropWindow;  // x0 y0 x1 y1 as fractions of the image; empty renders everything
+    bool cropFullSize = false;      // Write a crop render into a full-size image instead of just the window
+    bool denoise = false;           // Filter the finished image guided by albedo, normal and depth buffers
+    std::string aovFile;            // Write the feature buffers (AOVs) and color here as multi-channel OpenEXR
+    bool deterministic = false;     // Same image bytes for any thread count and tile order
+    bool checkDeterminism = false;  // Render with several thread counts and compare image hashes instead
+    bool runTests = false;          // Run the built-in tests and exit
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--heatmap" && i + 1 < argc) {
+            heatmapFile = argv[++i];
+        } else if (arg == "--timeline" && i + 1 < argc) {
+            timelineFile = argv[++i];
+        } else if (arg == "--server" && i + 1 < argc) {
+            serverSocket = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threadCount = std::atoi(argv[++i]);
+        } else if (arg == "--pin-threads") {
+            pinThreads = true;
+        } else if (arg == "--animate" && i + 1 < argc) {
+            keyframeFile = argv[++i];
+        } else if (arg == "--frames" && i + 1 < argc) {
+            frameCount = std::atoi(argv[++i]);
+        } else if (arg == "--coordinator" && i + 1 < argc) {
+            coordinatorAddress = argv[++i];
+        } else if (arg == "--worker" && i + 1 < argc) {
+            workerAddress = argv[++i];
+        } else if (arg == "--spawn-workers" && i + 1 < argc) {
+            spawnWorkers = std::atoi(argv[++i]);
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpointFile = argv[++i];
+        } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            checkpointInterval = std::atof(argv[++i]);
+        } else if (arg == "--scale" && i + 1 < argc) {
+            resolutionScale = static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--crop" && i + 4 < argc) {
+            cropWindow.clear();
+            for (int j = 0; j < 4; j++) {
+                cropWindow.push_back(static_cast<float>(std::atof(argv[++i])));
+            }
+        } else if (arg == "--crop-full-size") {
+            cropFullSize = true;
+        } else if (arg == "--denoise") {
+            denoise = true;
+        } else if (arg == "--aov" && i + 1 < argc) {
+            aovFile = argv[++i];
+        } else if (arg == "--deterministic") {
+            deterministic = true;
+        } else if (arg == "--verify-determinism") {
+            checkDeterminism = true;
+        } else if (arg == "--run-tests") {
+            runTests = true;
+        } else {
+            sceneFile = arg;
+        }
+    }
 
 //     renderBSOD();
 //
@@ -756,26 +967,173 @@ int main() {
 
 //    testTranspose();
 
+//    testTinyTriangles();
+
+//    testDeterminism();
+
 //    renderSphereBehindTriangle();
 
 //    renderSpheresBehindEachOtherWithTriangle();
 
+    if (runTests) {
+        testInverse();
+        testInverse2();
+        testTranspose();
+        testTinyTriangles();
+        testDeterminism();
+        return 0;
+    }
+
 //  PARSED
 
-    Parser parser = Parser();
-    Scene myScene = parser.parseFile("hw3-submissionscenes/scene1.test");
+    if (!timelineFile.empty()) {
+        Timeline::instance().enable();
+    }
+
+    if (!serverSocket.empty()) {
+        RenderServer server(serverSocket, threadCount, pinThreads);
+        server.run();
+        if (!timelineFile.empty()) {
+            Timeline::instance().writeJson(timelineFile);
+        }
+        return 0;
+    }
+
+    if (!workerAddress.empty()) {
+        RenderWorker worker(workerAddress, threadCount, pinThreads);
+        worker.run();
+        return 0;
+    }
+
+    // Mesh files load on the render threads. The coordinator forks its local workers after parsing, before
+    // any thread may exist, so it parses with a temporary pool instead.
+    RayTracer rayTracer;
+    if (coordinatorAddress.empty()) {
+        rayTracer.setThreadCount(threadCount, pinThreads);
+        rayTracer.deterministic = deterministic;
+    }
+
+    Parser parser;
+    Scene myScene;
+    try {
+        myScene = parser.parseFile(sceneFile, coordinatorAddress.empty() ? &rayTracer.threadPool() : nullptr);
+    } catch (const std::exception& e) {
+        std::cerr << "Unable to parse " << sceneFile << ": " << e.what() << std::endl;
+        return 1;
+    }
+    if (resolutionScale != 1.0f) {
+        myScene.scaleResolution(resolutionScale);
+    }
+    if (!cropWindow.empty()) {
+        myScene.setCropWindow(cropWindow[0], cropWindow[1], cropWindow[2], cropWindow[3]);
+    }
+    if (myScene.hasEmptyWindow()) {
+        std::cerr << "The crop window contains no pixels" << std::endl;
+        return 1;
+    }
     int width = myScene.width;
     int height = myScene.height;
-    Film film = Film(width, height);
+    Film film = myScene.isCropped() && !cropFullSize ? Film(myScene.pixelWindow()) : Film(width, height);
 
     std::cout << myScene << std::endl;
 
-    RayTracer rayTracer;
-    rayTracer.trace(myScene, film);
+#ifdef RAY_TRACER_STATS
+    if (!heatmapFile.empty()) {
+        film.enableCostBuffer();
+    }
+#else
+    if (!heatmapFile.empty()) {
+        std::cerr << "--heatmap needs an instrumentation build (-DRAY_TRACER_STATS), ignoring it" << std::endl;
+    }
+#endif
+
+    if (checkDeterminism) {
+        return verifyDeterminism(myScene, denoise) ? 0 : 1;
+    }
 
-    film.writeImage(parser.getOutputFilename());
+    if ((denoise || !aovFile.empty()) && (!coordinatorAddress.empty() || !keyframeFile.empty())) {
+        std::cerr << "--denoise and --aov only apply to single-frame local renders, ignoring them" << std::endl;
+        denoise = false;
+        aovFile.clear();
+    }
+    if (denoise || !aovFile.empty()) {
+        film.enableFeatureBuffers();
+    }
+
+    if (!coordinatorAddress.empty()) {
+        RenderCoordinator coordinator(coordinatorAddress);
+        coordinator.spawnLocalWorkers(spawnWorkers, threadCount);
+        coordinator.render(sceneFile, myScene, film);
+        bool written = film.writeImage(parser.getOutputFilename());
+        if (!timelineFile.empty()) {
+            Timeline::instance().writeJson(timelineFile);
+        }
+        return written ? 0 : 1;
+    }
+
+    if (!keyframeFile.empty()) {
+        CameraPath path;
+        path.load(keyframeFile);
+        renderAnimation(myScene, rayTracer, path, frameCount > 0 ? frameCount : path.frameCount(),
+                        parser.getOutputFilename());
+        if (!timelineFile.empty()) {
+            Timeline::instance().writeJson(timelineFile);
+        }
+        return 0;
+    }
+
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (!checkpointFile.empty()) {
+        uint64_t sceneHash = hashBytes(std::to_string(width) + "x" + std::to_string(height),
+                                       Checkpoint::hashFile(sceneFile, parser.getMeshFilenames()));
+        checkpoint.reset(new Checkpoint(checkpointFile, film, myScene.pixelWindow(), rayTracer.tileSize, sceneHash,
+                                        checkpointInterval));
+        if (checkpoint->resume()) {
+            std::cout << "Resuming from " << checkpointFile << ": " << checkpoint->doneTileCount() << " of "
+                      << checkpoint->tileCount() << " tiles already rendered" << std::endl;
+            if (denoise || !aovFile.empty()) {
+                std::cerr << "Checkpoints don't store feature buffers, skipping --denoise and --aov" << std::endl;
+                denoise = false;
+                aovFile.clear();
+            }
+        }
+        checkpoint->start();
+        rayTracer.trace(myScene, film, checkpoint->remainingTiles(), [&](const Tile& tile) {
+            checkpoint->markDone(tile);
+        });
+        checkpoint->stop();
+    } else {
+        rayTracer.trace(myScene, film);
+    }
+
+    if (denoise) {
+        auto denoiseStart = std::chrono::high_resolution_clock::now();
+        Denoiser().denoise(film, &rayTracer.threadPool());
+        std::cout << "Denoised in " << std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                                                     denoiseStart).count() << "s" << std::endl;
+    }
+
+    bool written = film.writeImage(parser.getOutputFilename(), &rayTracer.threadPool());
+    if (!aovFile.empty()) {
+        film.writeAovs(aovFile, width, height);
+    }
+    if (checkpoint) {
+        if (written) {
+            checkpoint->remove();
+        } else {
+            checkpoint->save(); // Every tile is done by now, so running again only writes the image
+            std::cerr << "Keeping checkpoint " << checkpointFile << ", run again to write the image" << std::endl;
+        }
+    }
+    if (film.hasCostBuffer()) {
+        film.writeHeatmap(heatmapFile);
+    }
+
+    if (!timelineFile.empty()) {
+        Timeline::instance().writeJson(timelineFile);
+    }
 
 
-    return 0;
+    return written ? 0 : 1;
 }
 